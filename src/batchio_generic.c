@@ -0,0 +1,81 @@
+/** gtping/src/batchio_generic.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * No batched I/O on this system. batchioInit() says so, and callers use
+ * plain send() and recv() instead. See batchio_uring.c.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+
+#include "gtping.h"
+
+/**
+ *
+ */
+int
+batchioInit()
+{
+        return -ENOSYS;
+}
+
+/**
+ *
+ */
+int
+batchioFd()
+{
+        return -1;
+}
+
+/**
+ *
+ */
+int
+batchioAddSocket(int fd)
+{
+        fd = fd;
+        return -ENOSYS;
+}
+
+/**
+ *
+ */
+ssize_t
+batchioSend(int fd, const void *packet, size_t len,
+            const struct sockaddr *to, socklen_t tolen, int64_t *sendTime)
+{
+        *sendTime = clock_get_ns();
+        if (to) {
+                return sendto(fd, packet, len, 0, to, tolen);
+        }
+        return send(fd, packet, len, 0);
+}
+
+/**
+ *
+ */
+void
+batchioFlush()
+{
+}
+
+/**
+ *
+ */
+int
+batchioNextPacket(struct RecvPacket *p)
+{
+        p = p;
+        return 0;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,237 @@
+/** gtping/src/batchio_mmsg.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Batched sending with sendmmsg(), for flood and multi-target modes.
+ *
+ * Packets queued with batchioSend() are sent by batchioFlush(), one
+ * sendmmsg() per socket for everything that was due. Receiving is not
+ * done here: batchioAddSocket() says so, and the caller reads the
+ * sockets itself.
+ *
+ * Systems known to use this code: Linux 3.0+ without io_uring
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/* for sendmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "gtping.h"
+
+#define BATCHIO_QUEUELEN 256     /* packets per batchioFlush() */
+#define BATCHIO_PKTSIZE 512      /* bigger packets are sent directly */
+
+/**
+ * A queued send.
+ */
+struct SendSlot {
+        int fd;
+        int64_t *sendTime;
+        struct iovec iov;
+        struct sockaddr_storage addr;
+        socklen_t addrlen;       /* 0 for connected sockets */
+        char packet[BATCHIO_PKTSIZE];
+};
+
+static THREADLOCAL struct SendSlot slots[BATCHIO_QUEUELEN];
+static THREADLOCAL int numQueued = 0;
+static THREADLOCAL struct mmsghdr msgs[BATCHIO_QUEUELEN];
+
+/* send errors not yet picked up by batchioNextPacket() */
+static THREADLOCAL struct {
+        int fd;
+        int err;
+} errors[BATCHIO_QUEUELEN];
+static THREADLOCAL int numErrors = 0;
+
+/**
+ * Nothing to set up.
+ */
+int
+batchioInit()
+{
+        return 0;
+}
+
+/**
+ * Nothing to wait for, replies are read from the sockets.
+ */
+int
+batchioFd()
+{
+        return -1;
+}
+
+/**
+ *
+ */
+int
+batchioAddSocket(int fd)
+{
+        fd = fd;
+        return -ENOSYS;
+}
+
+/**
+ * Remember error for batchioNextPacket().
+ */
+static void
+addError(int fd, int err)
+{
+        if (numErrors == BATCHIO_QUEUELEN) {
+                fprintf(stderr, "%s: sendmmsg(%d, ...): %s\n",
+                        argv0, fd, strerror(err));
+                return;
+        }
+        errors[numErrors].fd = fd;
+        errors[numErrors].err = err;
+        numErrors++;
+}
+
+/**
+ * Send msgs[0..n-1] on fd. order[] maps them back to their slots.
+ */
+static void
+sendBatch(int fd, const int *order, int n)
+{
+        int64_t now;
+        int done = 0;
+        int c;
+
+        now = clock_get_ns();
+        for (c = 0; c < n; c++) {
+                *slots[order[c]].sendTime = now;
+        }
+        while (done < n) {
+                int r;
+                if (0 > (r = sendmmsg(fd, msgs + done, n - done, 0))) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        /* first packet failed. Skip it and send the
+                         * rest */
+                        addError(fd, errno);
+                        done++;
+                        continue;
+                }
+                done += r;
+        }
+}
+
+/**
+ * Queue packet for sending. It's copied, so the caller can free it. 'to'
+ * is NULL for connected sockets. *sendTime is set when the packet is
+ * handed to the kernel.
+ *
+ * return len, or -1 with errno set. Errors from the actual send show up
+ * as packets with err set from batchioNextPacket().
+ */
+ssize_t
+batchioSend(int fd, const void *packet, size_t len,
+            const struct sockaddr *to, socklen_t tolen, int64_t *sendTime)
+{
+        struct SendSlot *slot;
+
+        if (len > BATCHIO_PKTSIZE || tolen > sizeof(slot->addr)) {
+                *sendTime = clock_get_ns();
+                if (to) {
+                        return sendto(fd, packet, len, 0, to, tolen);
+                }
+                return send(fd, packet, len, 0);
+        }
+        if (numQueued == BATCHIO_QUEUELEN) {
+                batchioFlush();
+        }
+
+        slot = &slots[numQueued++];
+        memcpy(slot->packet, packet, len);
+        slot->fd = fd;
+        slot->sendTime = sendTime;
+        slot->iov.iov_base = slot->packet;
+        slot->iov.iov_len = len;
+        slot->addrlen = 0;
+        if (to) {
+                memcpy(&slot->addr, to, tolen);
+                slot->addrlen = tolen;
+        }
+        return len;
+}
+
+/**
+ * Send everything queued, one sendmmsg() per socket, in the order they
+ * were queued.
+ */
+void
+batchioFlush()
+{
+        int order[BATCHIO_QUEUELEN];
+        int first;
+
+        for (first = 0; first < numQueued; first++) {
+                int fd = slots[first].fd;
+                int n = 0;
+                int c;
+
+                if (fd < 0) {
+                        /* already sent with an earlier socket */
+                        continue;
+                }
+                for (c = first; c < numQueued; c++) {
+                        struct SendSlot *slot = &slots[c];
+                        struct msghdr *msg = &msgs[n].msg_hdr;
+
+                        if (slot->fd != fd) {
+                                continue;
+                        }
+                        memset(msg, 0, sizeof(struct msghdr));
+                        if (slot->addrlen) {
+                                msg->msg_name = &slot->addr;
+                                msg->msg_namelen = slot->addrlen;
+                        }
+                        msg->msg_iov = &slot->iov;
+                        msg->msg_iovlen = 1;
+                        msgs[n].msg_len = 0;
+                        order[n++] = c;
+                        slot->fd = -1;
+                }
+                sendBatch(fd, order, n);
+        }
+        numQueued = 0;
+}
+
+/**
+ * Only send errors come from here.
+ *
+ * return 1 if 'p' was filled in, 0 if there is nothing more right now.
+ */
+int
+batchioNextPacket(struct RecvPacket *p)
+{
+        if (!numErrors) {
+                return 0;
+        }
+        numErrors--;
+        memset(p, 0, sizeof(struct RecvPacket));
+        p->fd = errors[numErrors].fd;
+        p->err = errors[numErrors].err;
+        p->sendErr = 1;
+        return 1;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,550 @@
+/** gtping/src/batchio_uring.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Batched sending and receiving using io_uring, for flood and
+ * multi-target modes.
+ *
+ * Sends are queued with batchioSend() and submitted together with
+ * batchioFlush(), one io_uring_enter() for the whole batch. Each socket
+ * has one multishot recvmsg outstanding, which puts every received
+ * datagram (with address and TTL/ToS control data) into a buffer from a
+ * registered buffer ring. batchioNextPacket() hands them to the caller
+ * one at a time. The ring fd becomes readable when there are
+ * completions, so it's all the main loop needs to wait for.
+ *
+ * liburing is not used, just the raw system calls.
+ *
+ * Systems known to use this code: Linux 6.0+
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "gtping.h"
+
+#define BATCHIO_ENTRIES 1024     /* SQ size. CQ is 4 times that */
+#define BATCHIO_SENDSLOTS 4096   /* sends in flight */
+#define BATCHIO_PKTSIZE 512      /* bigger packets are sent directly */
+#define BATCHIO_BUFS 1024        /* receive buffers, power of 2 */
+#define BATCHIO_BUFSIZE 2048
+#define BATCHIO_BGID 0
+#define BATCHIO_CONTROLLEN 128
+
+/* user_data is type in the top byte, and slot or fd in the rest */
+enum {
+        BATCHIO_SEND = 1,
+        BATCHIO_RECV = 2,
+};
+#define UD(type, val) (((uint64_t)(type) << 56) | (uint64_t)(val))
+#define UD_TYPE(ud) ((int)((ud) >> 56))
+#define UD_VAL(ud) ((int)((ud) & 0xffffffff))
+
+/**
+ * A queued or in-flight send. The kernel reads it when the send is
+ * executed, so it must stay put until the completion.
+ */
+struct SendSlot {
+        struct msghdr msg;
+        struct iovec iov;
+        struct sockaddr_storage addr;
+        int fd;
+        int nextFree;
+        int64_t *sendTime;
+        char packet[BATCHIO_PKTSIZE];
+};
+
+static THREADLOCAL int ringfd = -1;
+
+/* submission queue */
+static THREADLOCAL unsigned *sqHead;
+static THREADLOCAL unsigned *sqTail;
+static THREADLOCAL unsigned sqMask;
+static THREADLOCAL unsigned sqEntries;
+static THREADLOCAL struct io_uring_sqe *sqes;
+static THREADLOCAL unsigned sqLocalTail; /* tail incl. not yet published */
+static THREADLOCAL unsigned toSubmit = 0;
+
+/* completion queue */
+static THREADLOCAL unsigned *cqHead;
+static THREADLOCAL unsigned *cqTail;
+static THREADLOCAL unsigned cqMask;
+static THREADLOCAL struct io_uring_cqe *cqes;
+
+/* receive buffers */
+static THREADLOCAL struct io_uring_buf_ring *bufRing;
+static THREADLOCAL char *bufs;
+static THREADLOCAL unsigned short bufTail;
+static THREADLOCAL int heldBuf = -1;    /* given to caller, recycle next */
+
+/* recvmsg() template for the multishot receives. Only the name and
+ * control lengths are used. */
+static THREADLOCAL struct msghdr recvTemplate;
+
+static THREADLOCAL struct SendSlot *slots;
+static THREADLOCAL int freeSlot = -1;
+
+/* sends queued since the last submit. They get their send time when
+ * they are submitted. */
+static THREADLOCAL int unstamped[BATCHIO_ENTRIES];
+static THREADLOCAL int numUnstamped = 0;
+
+/**
+ *
+ */
+static int
+uringSetup(unsigned entries, struct io_uring_params *p)
+{
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+/**
+ *
+ */
+static int
+uringEnter(unsigned submit, unsigned minComplete, unsigned flags)
+{
+        return (int)syscall(__NR_io_uring_enter, ringfd, submit,
+                            minComplete, flags, NULL, 0);
+}
+
+/**
+ *
+ */
+static int
+uringRegister(unsigned opcode, void *arg, unsigned nrArgs)
+{
+        return (int)syscall(__NR_io_uring_register, ringfd, opcode,
+                            arg, nrArgs);
+}
+
+/**
+ * Give receive buffer 'bid' back to the kernel.
+ */
+static void
+bufRecycle(int bid)
+{
+        struct io_uring_buf *buf;
+
+        buf = &bufRing->bufs[bufTail & (BATCHIO_BUFS - 1)];
+        buf->addr = (uint64_t)(unsigned long)(bufs + bid * BATCHIO_BUFSIZE);
+        buf->len = BATCHIO_BUFSIZE;
+        buf->bid = bid;
+        bufTail++;
+        __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get a free SQE, submitting what's queued if the SQ is full. It's not
+ * published to the kernel until batchioFlush(), so the caller can fill
+ * it in first.
+ *
+ * return NULL if the SQ is still full.
+ */
+static struct io_uring_sqe*
+getSqe()
+{
+        struct io_uring_sqe *sqe;
+
+        if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE)
+            >= sqEntries) {
+                batchioFlush();
+                if (sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE)
+                    >= sqEntries) {
+                        return NULL;
+                }
+        }
+        sqe = &sqes[sqLocalTail & sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqLocalTail++;
+        toSubmit++;
+        return sqe;
+}
+
+/**
+ * Start (or restart) the multishot receive on fd.
+ */
+static int
+armRecv(int fd)
+{
+        struct io_uring_sqe *sqe;
+
+        if (!(sqe = getSqe())) {
+                return -EBUSY;
+        }
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(unsigned long)&recvTemplate;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BATCHIO_BGID;
+        sqe->user_data = UD(BATCHIO_RECV, fd);
+        return 0;
+}
+
+/**
+ * Set up the ring. Safe to call more than once.
+ *
+ * return 0 if io_uring can be used, <0 (-errno) if not. Callers then use
+ * plain send() and recv().
+ */
+int
+batchioInit()
+{
+        struct io_uring_params p;
+        struct io_uring_buf_reg reg;
+        size_t sqSize, cqSize;
+        char *sqPtr, *cqPtr;
+        unsigned *sqArray;
+        unsigned c;
+        int err;
+
+        if (ringfd >= 0) {
+                return 0;
+        }
+
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = 4 * BATCHIO_ENTRIES;
+        if (0 > (ringfd = uringSetup(BATCHIO_ENTRIES, &p))) {
+                err = errno;
+                if (options.verbose) {
+                        fprintf(stderr, "%s: io_uring_setup(): %s, "
+                                "not using io_uring\n",
+                                argv0, strerror(err));
+                }
+                return -err;
+        }
+
+        sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (cqSize > sqSize) {
+                        sqSize = cqSize;
+                }
+                cqSize = sqSize;
+        }
+        sqPtr = mmap(0, sqSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+        if (sqPtr == MAP_FAILED) {
+                goto errout;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                cqPtr = sqPtr;
+        } else {
+                cqPtr = mmap(0, cqSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ringfd,
+                             IORING_OFF_CQ_RING);
+                if (cqPtr == MAP_FAILED) {
+                        goto errout;
+                }
+        }
+        sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ringfd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+                goto errout;
+        }
+
+        sqHead = (unsigned*)(sqPtr + p.sq_off.head);
+        sqTail = (unsigned*)(sqPtr + p.sq_off.tail);
+        sqMask = *(unsigned*)(sqPtr + p.sq_off.ring_mask);
+        sqEntries = p.sq_entries;
+        sqArray = (unsigned*)(sqPtr + p.sq_off.array);
+        for (c = 0; c < sqEntries; c++) {
+                sqArray[c] = c;
+        }
+        sqLocalTail = *sqTail;
+
+        cqHead = (unsigned*)(cqPtr + p.cq_off.head);
+        cqTail = (unsigned*)(cqPtr + p.cq_off.tail);
+        cqMask = *(unsigned*)(cqPtr + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(cqPtr + p.cq_off.cqes);
+
+        /* receive buffers */
+        bufRing = mmap(0, BATCHIO_BUFS * sizeof(struct io_uring_buf),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+        if (bufRing == MAP_FAILED) {
+                goto errout;
+        }
+        if (!(bufs = malloc(BATCHIO_BUFS * BATCHIO_BUFSIZE))) {
+                goto errout;
+        }
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(unsigned long)bufRing;
+        reg.ring_entries = BATCHIO_BUFS;
+        reg.bgid = BATCHIO_BGID;
+        if (uringRegister(IORING_REGISTER_PBUF_RING, &reg, 1)) {
+                goto errout;
+        }
+        bufTail = 0;
+        for (c = 0; c < BATCHIO_BUFS; c++) {
+                bufRecycle(c);
+        }
+
+        /* send slots */
+        if (!(slots = malloc(BATCHIO_SENDSLOTS * sizeof(struct SendSlot)))) {
+                goto errout;
+        }
+        for (c = 0; c < BATCHIO_SENDSLOTS; c++) {
+                slots[c].nextFree = (c + 1 < BATCHIO_SENDSLOTS)
+                        ? (int)c + 1 : -1;
+        }
+        freeSlot = 0;
+
+        memset(&recvTemplate, 0, sizeof(recvTemplate));
+        recvTemplate.msg_namelen = sizeof(struct sockaddr_storage);
+        recvTemplate.msg_controllen = BATCHIO_CONTROLLEN;
+
+        if (options.verbose > 1) {
+                fprintf(stderr, "%s: using io_uring\n", argv0);
+        }
+        return 0;
+
+ errout:
+        err = errno;
+        if (options.verbose) {
+                fprintf(stderr, "%s: io_uring setup: %s, "
+                        "not using io_uring\n",
+                        argv0, strerror(err));
+        }
+        /* the rest is leaked, it's a one-time thing */
+        close(ringfd);
+        ringfd = -1;
+        return -(err ? err : ENOMEM);
+}
+
+/**
+ * fd for the event loop. Readable when batchioNextPacket() has something.
+ */
+int
+batchioFd()
+{
+        return ringfd;
+}
+
+/**
+ * Start receiving on fd. Its packets are returned by batchioNextPacket().
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+int
+batchioAddSocket(int fd)
+{
+        int err;
+        if ((err = armRecv(fd))) {
+                return err;
+        }
+        batchioFlush();
+        return 0;
+}
+
+/**
+ * Queue packet for sending. It's copied, so the caller can free it. 'to'
+ * is NULL for connected sockets. *sendTime is set when the packet is
+ * handed to the kernel.
+ *
+ * return len, or -1 with errno set. Errors from the actual send show up
+ * as packets with err set from batchioNextPacket().
+ */
+ssize_t
+batchioSend(int fd, const void *packet, size_t len,
+            const struct sockaddr *to, socklen_t tolen, int64_t *sendTime)
+{
+        struct io_uring_sqe *sqe;
+        struct SendSlot *slot;
+        int n;
+
+        if (numUnstamped == BATCHIO_ENTRIES) {
+                batchioFlush();
+        }
+        if (freeSlot < 0 || len > BATCHIO_PKTSIZE || !(sqe = getSqe())) {
+                /* all busy. Do it the old way */
+                *sendTime = clock_get_ns();
+                if (to) {
+                        return sendto(fd, packet, len, 0, to, tolen);
+                }
+                return send(fd, packet, len, 0);
+        }
+
+        n = freeSlot;
+        slot = &slots[n];
+        freeSlot = slot->nextFree;
+
+        memcpy(slot->packet, packet, len);
+        slot->fd = fd;
+        slot->sendTime = sendTime;
+        slot->iov.iov_base = slot->packet;
+        slot->iov.iov_len = len;
+        memset(&slot->msg, 0, sizeof(slot->msg));
+        if (to) {
+                memcpy(&slot->addr, to, tolen);
+                slot->msg.msg_name = &slot->addr;
+                slot->msg.msg_namelen = tolen;
+        }
+        slot->msg.msg_iov = &slot->iov;
+        slot->msg.msg_iovlen = 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(unsigned long)&slot->msg;
+        sqe->len = 1;
+        sqe->user_data = UD(BATCHIO_SEND, n);
+        unstamped[numUnstamped++] = n;
+        return len;
+}
+
+/**
+ * Submit everything queued.
+ */
+void
+batchioFlush()
+{
+        if (numUnstamped) {
+                int64_t now = clock_get_ns();
+                int c;
+                for (c = 0; c < numUnstamped; c++) {
+                        *slots[unstamped[c]].sendTime = now;
+                }
+                numUnstamped = 0;
+        }
+
+        /* publish the filled in SQEs. The SQ array is set up as identity
+         * so there is nothing else to fill in */
+        __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+        while (toSubmit) {
+                int n;
+                if (0 > (n = uringEnter(toSubmit, 0, 0))) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        if (errno != EAGAIN && errno != EBUSY) {
+                                fprintf(stderr, "%s: io_uring_enter(): %s\n",
+                                        argv0, strerror(errno));
+                        }
+                        /* try again next time */
+                        return;
+                }
+                toSubmit -= n;
+        }
+}
+
+/**
+ * Get next received packet or receive error. The packet data is valid
+ * until the next call.
+ *
+ * return 1 if 'p' was filled in, 0 if there is nothing more right now.
+ */
+int
+batchioNextPacket(struct RecvPacket *p)
+{
+        if (heldBuf >= 0) {
+                bufRecycle(heldBuf);
+                heldBuf = -1;
+        }
+
+        for (;;) {
+                struct io_uring_cqe cqe;
+                struct io_uring_recvmsg_out *out;
+                struct msghdr msgh;
+                unsigned head;
+                char *buf;
+                char *name;
+                char *control;
+                size_t avail;
+
+                head = *cqHead;
+                if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+                        return 0;
+                }
+                cqe = cqes[head & cqMask];
+                __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+
+                memset(p, 0, sizeof(*p));
+                p->ttl = -1;
+                p->tos = -1;
+                p->time = clock_get_ns();
+
+                if (UD_TYPE(cqe.user_data) == BATCHIO_SEND) {
+                        struct SendSlot *slot = &slots[UD_VAL(cqe.user_data)];
+                        p->fd = slot->fd;
+                        slot->nextFree = freeSlot;
+                        freeSlot = UD_VAL(cqe.user_data);
+                        if (cqe.res >= 0) {
+                                continue;
+                        }
+                        p->err = -cqe.res;
+                        p->sendErr = 1;
+                        return 1;
+                }
+
+                /* receive */
+                p->fd = UD_VAL(cqe.user_data);
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                        /* multishot stopped (error or out of buffers) */
+                        armRecv(p->fd);
+                        batchioFlush();
+                }
+                if (cqe.res < 0) {
+                        if (cqe.res == -ENOBUFS) {
+                                continue;
+                        }
+                        p->err = -cqe.res;
+                        return 1;
+                }
+                if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+                        continue;
+                }
+
+                heldBuf = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                buf = bufs + heldBuf * BATCHIO_BUFSIZE;
+                out = (struct io_uring_recvmsg_out*)buf;
+                name = buf + sizeof(*out);
+                control = name + recvTemplate.msg_namelen;
+                p->data = control + recvTemplate.msg_controllen;
+                if ((size_t)cqe.res < (size_t)(p->data - buf)) {
+                        /* can't happen */
+                        bufRecycle(heldBuf);
+                        heldBuf = -1;
+                        continue;
+                }
+                avail = cqe.res - (p->data - buf);
+
+                p->len = out->payloadlen;
+                if (p->len > avail) {
+                        p->len = avail;
+                }
+                p->fromlen = out->namelen;
+                if (p->fromlen > sizeof(p->from)) {
+                        p->fromlen = sizeof(p->from);
+                }
+                memcpy(&p->from, name, p->fromlen);
+
+                memset(&msgh, 0, sizeof(msgh));
+                msgh.msg_control = control;
+                msgh.msg_controllen = out->controllen;
+                doRecvParseCmsg(&msgh, &p->ttl, &p->tos, &p->time);
+                return 1;
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -5,6 +5,8 @@
  * This provides the recv*() wrapper for systems that export ToS and TTL
  * data via msghdr.msg_control
  *
+ * Replies are read in batches, with recvmmsg() if there is one.
+ *
  * Systems known to use this code: Linux, FreeBSD, Solaris.
  *
  * FreeBSD and Solaris don't seem to have IP_RECVTOS or equivalent, so
@@ -15,6 +17,11 @@
 #endif
 #define __APPLE_USE_RFC_2292
 
+/* recvmmsg() needs this */
+#if defined(HAVE_RECVMMSG) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 /* For Solaris we need some defines */
 #if defined (__SVR4) && defined (__sun)
 /* SUS (XPG4v2) */
@@ -26,11 +33,14 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
 #ifdef HAVE_SYS_UIO_H
 #include <sys/uio.h>
@@ -46,41 +56,58 @@
 #define SOL_IPV6 IPPROTO_IPV6
 #endif
 
+#define DORECV_BUFSIZE 1024
+
+/* Control data per message. TTL/hop limit, ToS/traffic class and receive
+ * timestamp, with room to spare. */
+#define DORECV_CONTROLLEN (4 * CMSG_SPACE(sizeof(int))                 \
+                           + 3 * CMSG_SPACE(sizeof(struct timespec)))
+
+static THREADLOCAL char bufs[RECV_BATCH][DORECV_BUFSIZE];
+static THREADLOCAL char controls[RECV_BATCH][DORECV_CONTROLLEN];
+
 /**
- * 
+ * Get TTL, ToS and kernel receive timestamp out of the control data of a
+ * received message. They're left alone if not there. The timestamp is
+ * converted to the clock_get_ns() clock.
  */
-ssize_t
-doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
+void
+doRecvParseCmsg(struct msghdr *msgh, int *ttl, int *tos, int64_t *when)
 {
-        struct msghdr msgh;
         struct cmsghdr *cmsg;
-        struct iovec iov;
-        char msgcontrol[10000];
-        ssize_t n;
-
-	if (options.verbose > 2) {
-		fprintf(stderr, "%s: doRecv[cmsg]()\n", argv0);
-	}
-
-        *ttl = -1;
-        *tos = -1;
-
-        memset(&iov, 0, sizeof(iov));
-        iov.iov_base = data;
-        iov.iov_len = len;
-
-        memset(&msgh, 0, sizeof(msgh));
-        
-        msgh.msg_iov = &iov;
-        msgh.msg_iovlen = 1;
-        msgh.msg_control = msgcontrol;
-        msgh.msg_controllen = sizeof(msgcontrol);
-
-        n = recvmsg(sock, &msgh, MSG_WAITALL);
 
-        for (cmsg = CMSG_FIRSTHDR(&msgh);
-             (0 < n) && (cmsg != NULL);
-             cmsg = CMSG_NXTHDR(&msgh,cmsg)) {
+        for (cmsg = CMSG_FIRSTHDR(msgh);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(msgh,cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET) {
+                        switch (cmsg->cmsg_type) {
+#ifdef SCM_TIMESTAMPNS
+                        case SCM_TIMESTAMPNS: {
+                                struct timespec ts;
+                                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                                if (when) {
+                                        *when = clock_from_realtime(
+                                                (int64_t)ts.tv_sec * NS_PER_SEC
+                                                + ts.tv_nsec);
+                                }
+                                break;
+                        }
+#endif
+#ifdef SCM_TIMESTAMP
+                        case SCM_TIMESTAMP: {
+                                struct timeval tv;
+                                memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+                                if (when) {
+                                        *when = clock_from_realtime(
+                                                (int64_t)tv.tv_sec * NS_PER_SEC
+                                                + tv.tv_usec * 1000);
+                                }
+                                break;
+                        }
+#endif
+                        }
+                        continue;
+                }
                 if (cmsg->cmsg_level == SOL_IP
                     || cmsg->cmsg_level == SOL_IPV6) {
                         switch(cmsg->cmsg_type) {
@@ -115,11 +142,106 @@ doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
                         }
                 }
         }
+}
+
+/**
+ * Point msgh at the buffers of batch slot 'slot', and the address at p.
+ */
+static void
+setupMsg(struct msghdr *msgh, struct iovec *iov, int slot,
+         struct RecvPacket *p)
+{
+        iov->iov_base = bufs[slot];
+        iov->iov_len = sizeof(bufs[slot]);
+
+        memset(msgh, 0, sizeof(struct msghdr));
+        msgh->msg_name = &p->from;
+        msgh->msg_namelen = sizeof(p->from);
+        msgh->msg_iov = iov;
+        msgh->msg_iovlen = 1;
+        msgh->msg_control = controls[slot];
+        msgh->msg_controllen = sizeof(controls[slot]);
+}
+
+/**
+ * Fill in p from a received message in batch slot 'slot'. 'now' is used
+ * as receive time if the kernel didn't timestamp the packet.
+ */
+static void
+finishMsg(struct msghdr *msgh, int slot, size_t len, int64_t now,
+          int sock, struct RecvPacket *p)
+{
+        p->fd = sock;
+        p->err = 0;
+        p->sendErr = 0;
+        p->data = bufs[slot];
+        p->len = len;
+        p->ttl = -1;
+        p->tos = -1;
+        p->fromlen = msgh->msg_namelen;
+        p->time = now;
+        doRecvParseCmsg(msgh, &p->ttl, &p->tos, &p->time);
+}
+
+/**
+ * Read up to maxPkts (at most RECV_BATCH) packets without blocking. The
+ * packet data is valid until the next call.
+ *
+ * return number of packets read, or -1 with errno set if the first read
+ * failed (EAGAIN if there was nothing to read).
+ */
+int
+doRecvBatch(int sock, struct RecvPacket *pkts, int maxPkts)
+{
+#ifdef HAVE_RECVMMSG
+        struct mmsghdr msgs[RECV_BATCH];
+        int c;
+#else
+        struct msghdr msgh;
+#endif
+        struct iovec iovs[RECV_BATCH];
+        int64_t now;
+        int n;
 
 	if (options.verbose > 2) {
-		fprintf(stderr, "%s: doRecv[cmsg]() = %d\n", argv0, (int)n);
+		fprintf(stderr, "%s: doRecvBatch[cmsg](%d)\n", argv0, sock);
 	}
 
+        if (maxPkts > RECV_BATCH) {
+                maxPkts = RECV_BATCH;
+        }
+
+#ifdef HAVE_RECVMMSG
+        for (c = 0; c < maxPkts; c++) {
+                setupMsg(&msgs[c].msg_hdr, &iovs[c], c, &pkts[c]);
+                msgs[c].msg_len = 0;
+        }
+        if (0 > (n = recvmmsg(sock, msgs, maxPkts, MSG_DONTWAIT, NULL))) {
+                return -1;
+        }
+        now = clock_get_ns();
+        for (c = 0; c < n; c++) {
+                finishMsg(&msgs[c].msg_hdr, c, msgs[c].msg_len, now,
+                          sock, &pkts[c]);
+        }
+#else
+        for (n = 0; n < maxPkts; n++) {
+                ssize_t len;
+                setupMsg(&msgh, &iovs[n], n, &pkts[n]);
+                if (0 > (len = recvmsg(sock, &msgh, MSG_DONTWAIT))) {
+                        if (!n) {
+                                return -1;
+                        }
+                        break;
+                }
+                now = clock_get_ns();
+                finishMsg(&msgh, n, len, now, sock, &pkts[n]);
+        }
+#endif
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: doRecvBatch[cmsg]() = %d\n", argv0, n);
+	}
         return n;
 }
 
@@ -18,15 +18,48 @@
 
 #include "gtping.h"
 
+#define DORECV_BUFSIZE 1024
+
+static THREADLOCAL char bufs[RECV_BATCH][DORECV_BUFSIZE];
+
 /**
- * 
+ * Read up to maxPkts (at most RECV_BATCH) packets without blocking. The
+ * packet data is valid until the next call.
+ *
+ * return number of packets read, or -1 with errno set if the first read
+ * failed (EAGAIN if there was nothing to read).
  */
-ssize_t
-doRecv(int sock, void *data, size_t len, int *ttl, int *tos)
+int
+doRecvBatch(int sock, struct RecvPacket *pkts, int maxPkts)
 {
-        *ttl = -1;
-        *tos = -1;
-        return recv(sock, data, len, 0);
+        int n;
+
+        if (maxPkts > RECV_BATCH) {
+                maxPkts = RECV_BATCH;
+        }
+        for (n = 0; n < maxPkts; n++) {
+                struct RecvPacket *p = &pkts[n];
+                ssize_t len;
+
+                p->fromlen = sizeof(p->from);
+                if (0 > (len = recvfrom(sock, bufs[n], sizeof(bufs[n]), 0,
+                                        (struct sockaddr*)&p->from,
+                                        &p->fromlen))) {
+                        if (!n) {
+                                return -1;
+                        }
+                        break;
+                }
+                p->fd = sock;
+                p->err = 0;
+                p->sendErr = 0;
+                p->data = bufs[n];
+                p->len = len;
+                p->ttl = -1;
+                p->tos = -1;
+                p->time = clock_get_ns();
+        }
+        return n;
 }
 
 /* ---- Emacs Variables ----
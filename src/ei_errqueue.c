@@ -4,6 +4,10 @@
  *
  * Handle icmp errors delivered via recvmsg() with MSG_ERRQUEUE.
  *
+ * Transmit timestamps from SO_TIMESTAMPING come through the same queue.
+ * They're handed to handleTxTimestamp() and skipped, so callers only see
+ * real errors.
+ *
  * Systems known to use this code: Linux
  *
  */
@@ -15,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include <netdb.h>
 
@@ -30,6 +35,7 @@
 # define __u8 uint8_t
 # define __u32 uint32_t
 # include <linux/errqueue.h>
+# include <linux/net_tstamp.h>
 # undef __u8
 # undef __u32
  /* Sometimes these constants are wrong in the headers, so we check both the
@@ -39,7 +45,10 @@
 # define REAL_IPV6_HOPLIMIT           52
 #endif
 
-static unsigned int icmpError = 0;
+/* handleRecvErrOne() return value for a transmit timestamp */
+#define RECVERR_TIMESTAMP -2
+
+static THREADLOCAL unsigned int icmpError = 0;
 
 void
 errInspectionPrintSummary()
@@ -47,6 +56,24 @@ errInspectionPrintSummary()
         printf(", %u ICMP error", icmpError);
 }
 
+/**
+ * Number of ICMP errors seen by this thread.
+ */
+unsigned int
+errInspectionCount()
+{
+        return icmpError;
+}
+
+/**
+ * Add ICMP errors seen by another thread, for the summary.
+ */
+void
+errInspectionMerge(unsigned int count)
+{
+        icmpError += count;
+}
+
 /**
  *
  */
@@ -88,8 +115,34 @@ errInspectionInit(int fd, const struct addrinfo *addrs)
 	}
 }
 
+/**
+ * Have the kernel timestamp packets sent on fd when they leave, and report
+ * it on the error queue. Only for sockets whose error queue is read as
+ * soon as there's something on it, or it will fill up.
+ */
+void
+errInspectionTxTimestamps(int fd)
+{
+#ifdef SO_TIMESTAMPING
+        int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (setsockopt(fd,
+		       SOL_SOCKET,
+		       SO_TIMESTAMPING,
+		       &flags,
+		       sizeof(flags))) {
+		fprintf(stderr,
+			"%s: setsockopt(%d, SOL_SOCKET, "
+			"SO_TIMESTAMPING, 0x%x): %s\n",
+			argv0, fd, flags, strerror(errno));
+	}
+#else
+        fd = fd;
+#endif
+}
+
 /**
  * return:
+ *     -1 if the error queue was empty
  *      0 if no error
  *      1 if TTL exceeded
  *     >1 if other icmp-like error
@@ -98,7 +151,7 @@ static int
 handleRecvErrSEE(struct sock_extended_err *see,
                  int returnttl,
                  const char *tos,
-                 double lastPingTime)
+                 int64_t lastPingTime)
 {
 	int isicmp = 0;
         int ret = 0;
@@ -146,7 +199,7 @@ handleRecvErrSEE(struct sock_extended_err *see,
                         }
                         if (lastPingTime) {
                                 printf(" time=%.2f ms",
-                                       1000*(clock_get_dbl()-lastPingTime));
+                                       NS2MS(clock_get_ns()-lastPingTime));
                         }
                         printf(": ");
 		}
@@ -202,13 +255,17 @@ handleRecvErrSEE(struct sock_extended_err *see,
 }
 
 /**
+ * Handle one message from the error queue.
+ *
  * return:
+ *     RECVERR_TIMESTAMP if it was a transmit timestamp
+ *     -1 if the error queue was empty
  *      0 if no error
  *      1 if TTL exceeded
  *     >1 if other icmp-like error
  */
-int
-handleRecvErr(int fd, const char *reason, double lastPingTime)
+static int
+handleRecvErrOne(int fd, const char *reason, int64_t lastPingTime)
 {
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
@@ -220,6 +277,7 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 	int returnttl = -1;
         char *tos = 0;
         int ret = 0;
+        int64_t txTime = 0;
 
         /* ignore reason, we know better */
         reason = reason;
@@ -237,6 +295,7 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 	
 	if (0 > (n = recvmsg(fd, &msg, MSG_ERRQUEUE))) {
 		if (errno == EAGAIN) {
+                        ret = -1;
                         goto errout;
 		}
 		fprintf(stderr, "%s: recvmsg(%d, ..., MSG_ERRQUEUE): %s\n",
@@ -256,6 +315,19 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
 			)) {
 			returnttl = *(int*)CMSG_DATA(cmsg);
 		}
+#ifdef SCM_TIMESTAMPING
+                if (cmsg->cmsg_level == SOL_SOCKET
+                    && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                        /* software timestamp is the first of three */
+                        struct timespec ts;
+                        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                        if (ts.tv_sec || ts.tv_nsec) {
+                                txTime = clock_from_realtime(
+                                        (int64_t)ts.tv_sec * NS_PER_SEC
+                                        + ts.tv_nsec);
+                        }
+                }
+#endif
 	}
 	for (cmsg = CMSG_FIRSTHDR(&msg);
 	     cmsg;
@@ -288,6 +360,18 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
                                 }
 			case IP_RECVERR:
 			case IPV6_RECVERR:
+#ifdef SO_EE_ORIGIN_TIMESTAMPING
+                                if (((struct sock_extended_err*)
+                                     CMSG_DATA(cmsg))->ee_origin
+                                    == SO_EE_ORIGIN_TIMESTAMPING) {
+                                        if (txTime) {
+                                                handleTxTimestamp(buf, n,
+                                                                  txTime);
+                                        }
+                                        ret = RECVERR_TIMESTAMP;
+                                        break;
+                                }
+#endif
                                 ret = handleRecvErrSEE((struct
                                                         sock_extended_err*)
                                                        CMSG_DATA(cmsg),
@@ -321,6 +405,27 @@ handleRecvErr(int fd, const char *reason, double lastPingTime)
         return ret;
 }
 
+/**
+ * Handle the next error on the error queue, skipping past transmit
+ * timestamps.
+ *
+ * return:
+ *     -1 if the error queue was empty
+ *      0 if no error
+ *      1 if TTL exceeded
+ *     >1 if other icmp-like error
+ */
+int
+handleRecvErr(int fd, const char *reason, int64_t lastPingTime)
+{
+        int ret;
+
+        while (RECVERR_TIMESTAMP
+               == (ret = handleRecvErrOne(fd, reason, lastPingTime))) {
+        }
+        return ret;
+}
+
 /* ---- Emacs Variables ----
  * Local Variables:
  * c-basic-offset: 8
@@ -26,6 +26,15 @@ errInspectionInit(int fd, const struct addrinfo *addrs)
 {
 }
 
+/**
+ *
+ */
+void
+errInspectionTxTimestamps(int fd)
+{
+        fd = fd;
+}
+
 /**
  *
  */
@@ -34,6 +43,24 @@ errInspectionPrintSummary()
 {
 }
 
+/**
+ *
+ */
+unsigned int
+errInspectionCount()
+{
+        return 0;
+}
+
+/**
+ *
+ */
+void
+errInspectionMerge(unsigned int count)
+{
+        count = count;
+}
+
 /**
  * return:
  *      0 if no error
@@ -41,7 +68,7 @@ errInspectionPrintSummary()
  *     >1 if other icmp-like error
  */
 int
-handleRecvErr(int fd, const char *reason, double lastPingTime)
+handleRecvErr(int fd, const char *reason, int64_t lastPingTime)
 {
         fd = fd;
         if (reason) {
@@ -0,0 +1,245 @@
+/** gtping/src/eventloop_epoll.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Wait for sockets and deadlines using epoll() and a timerfd.
+ *
+ * The deadline is kept in a timerfd that's part of the epoll set, so
+ * timeouts have sub-millisecond resolution and the timer is only
+ * re-armed when the deadline changes.
+ *
+ * epoll refuses regular files (a target list given with -L). Those are
+ * always readable, so they're just reported as such on every call.
+ *
+ * Systems known to use this code: Linux
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+
+#include "gtping.h"
+
+#define EVENTLOOP_MAX_ALWAYSREADY 4
+
+static THREADLOCAL int epfd = -1;
+static THREADLOCAL int timerfd = -1;
+/* what timerfd is set to, -1 = off */
+static THREADLOCAL int64_t armedDeadline = -1;
+static THREADLOCAL int alwaysReady[EVENTLOOP_MAX_ALWAYSREADY];
+static THREADLOCAL int numAlwaysReady = 0;
+
+/**
+ *
+ */
+static int
+eventLoopInit()
+{
+        struct epoll_event ev;
+        int err;
+
+        if (0 > (epfd = epoll_create(64))) {
+                err = errno;
+                fprintf(stderr, "%s: epoll_create(): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+#ifdef PR_SET_TIMERSLACK
+        /* default timer slack is 50us, too much for short intervals */
+        if (prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL)) {
+                fprintf(stderr, "%s: prctl(PR_SET_TIMERSLACK): %s\n",
+                        argv0, strerror(errno));
+        }
+#endif
+        if (0 > (timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                          TFD_NONBLOCK | TFD_CLOEXEC))) {
+                err = errno;
+                fprintf(stderr, "%s: timerfd_create(): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = timerfd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev)) {
+                err = errno;
+                fprintf(stderr, "%s: epoll_ctl(ADD, timerfd): %s\n",
+                        argv0, strerror(err));
+                return -err;
+        }
+        return 0;
+}
+
+/**
+ * Start watching fd for reading and errors. If 'edge' is set, readiness
+ * is only reported when new data arrives, and the caller must read until
+ * EAGAIN.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+int
+eventLoopAdd(int fd, int edge)
+{
+        struct epoll_event ev;
+        int err;
+
+        if (epfd < 0 && (err = eventLoopInit())) {
+                return err;
+        }
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | (edge ? EPOLLET : 0);
+        ev.data.fd = fd;
+        if (!epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+                return 0;
+        }
+        err = errno;
+        if (err == EPERM
+            && numAlwaysReady < EVENTLOOP_MAX_ALWAYSREADY) {
+                /* regular file */
+                alwaysReady[numAlwaysReady++] = fd;
+                return 0;
+        }
+        fprintf(stderr, "%s: epoll_ctl(ADD, %d): %s\n",
+                argv0, fd, strerror(err));
+        return -err;
+}
+
+/**
+ * Stop watching fd. Call before closing it.
+ */
+void
+eventLoopDel(int fd)
+{
+        struct epoll_event ev;
+        int c;
+
+        for (c = 0; c < numAlwaysReady; c++) {
+                if (alwaysReady[c] == fd) {
+                        alwaysReady[c] = alwaysReady[--numAlwaysReady];
+                        return;
+                }
+        }
+        if (epfd >= 0) {
+                /* ev is ignored, but old kernels want it non-NULL */
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+        }
+}
+
+/**
+ * Point the timer at deadline, unless it's already there.
+ *
+ * The timer is set to the absolute deadline when it's on the same clock
+ * as clock_get_ns(), so time spent between reading the clock and setting
+ * the timer doesn't make us wake up late.
+ */
+static void
+eventLoopSetTimer(int64_t deadline, int64_t now)
+{
+        struct itimerspec its;
+        int flags = 0;
+
+        if (deadline == armedDeadline) {
+                return;
+        }
+        memset(&its, 0, sizeof(its));
+        if (deadline >= 0) {
+                int64_t when;
+#ifdef HAVE_CLOCK_MONOTONIC
+                when = deadline;
+                flags = TFD_TIMER_ABSTIME;
+                now = now;
+#else
+                when = deadline - now;
+#endif
+                its.it_value.tv_sec = when / NS_PER_SEC;
+                its.it_value.tv_nsec = when % NS_PER_SEC;
+                if (!its.it_value.tv_sec && !its.it_value.tv_nsec) {
+                        /* zero would disarm it */
+                        its.it_value.tv_nsec = 1;
+                }
+        }
+        if (timerfd_settime(timerfd, flags, &its, NULL)) {
+                fprintf(stderr, "%s: timerfd_settime(): %s\n",
+                        argv0, strerror(errno));
+        }
+        armedDeadline = deadline;
+}
+
+/**
+ * Wait until something happens on one of the fds, or until 'deadline'
+ * (as returned by clock_get_ns()). deadline < 0 means wait forever.
+ *
+ * return number of events written to 'events', 0 on timeout, or -1 with
+ * errno set on error.
+ */
+int
+eventLoopWait(int64_t deadline, struct Event *events, int maxEvents)
+{
+        struct epoll_event evs[64];
+        int timeout = -1;
+        int nevents = 0;
+        int64_t now;
+        int n;
+        int c;
+
+        if (epfd < 0 && eventLoopInit()) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        now = clock_get_ns();
+        if (numAlwaysReady || (deadline >= 0 && deadline <= now)) {
+                timeout = 0;
+        } else {
+                eventLoopSetTimer(deadline, now);
+        }
+
+        if (maxEvents > (int)(sizeof(evs) / sizeof(evs[0]))) {
+                maxEvents = sizeof(evs) / sizeof(evs[0]);
+        }
+        if (0 > (n = epoll_wait(epfd, evs, maxEvents, timeout))) {
+                return -1;
+        }
+
+        for (c = 0; c < n; c++) {
+                if (evs[c].data.fd == timerfd) {
+                        uint64_t expirations;
+                        if (0 > read(timerfd, &expirations,
+                                     sizeof(expirations))) {
+                                /* EAGAIN: re-armed before we got here */
+                        }
+                        armedDeadline = -1;
+                        continue;
+                }
+                events[nevents].fd = evs[c].data.fd;
+                events[nevents].events = 0;
+                if (evs[c].events & (EPOLLIN | EPOLLHUP)) {
+                        events[nevents].events |= EVENT_READ;
+                }
+                if (evs[c].events & EPOLLERR) {
+                        events[nevents].events |= EVENT_ERROR;
+                }
+                nevents++;
+        }
+        for (c = 0; c < numAlwaysReady && nevents < maxEvents; c++) {
+                events[nevents].fd = alwaysReady[c];
+                events[nevents].events = EVENT_READ;
+                nevents++;
+        }
+        return nevents;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
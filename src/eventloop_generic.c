@@ -0,0 +1,116 @@
+/** gtping/src/eventloop_generic.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Wait for sockets and deadlines using poll(). Same interface as
+ * eventloop_epoll.c. Everything is level triggered, which is fine for
+ * callers that read until EAGAIN anyway.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "gtping.h"
+
+static THREADLOCAL struct pollfd *fds = 0;
+static THREADLOCAL int nfds = 0;
+static THREADLOCAL int allocfds = 0;
+
+/**
+ * Start watching fd for reading and errors. 'edge' is ignored.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+int
+eventLoopAdd(int fd, int edge)
+{
+        edge = edge; /* silence warning */
+        if (nfds == allocfds) {
+                struct pollfd *p;
+                int n = allocfds ? allocfds * 2 : 8;
+                if (!(p = realloc(fds, n * sizeof(struct pollfd)))) {
+                        int err = errno;
+                        fprintf(stderr, "%s: realloc(): %s\n",
+                                argv0, strerror(err));
+                        return -err;
+                }
+                fds = p;
+                allocfds = n;
+        }
+        fds[nfds].fd = fd;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+        return 0;
+}
+
+/**
+ * Stop watching fd. Call before closing it.
+ */
+void
+eventLoopDel(int fd)
+{
+        int c;
+        for (c = 0; c < nfds; c++) {
+                if (fds[c].fd == fd) {
+                        fds[c] = fds[--nfds];
+                        return;
+                }
+        }
+}
+
+/**
+ * Wait until something happens on one of the fds, or until 'deadline'
+ * (as returned by clock_get_ns()). deadline < 0 means wait forever.
+ *
+ * return number of events written to 'events', 0 on timeout, or -1 with
+ * errno set on error.
+ */
+int
+eventLoopWait(int64_t deadline, struct Event *events, int maxEvents)
+{
+        int timeout = -1;
+        int nevents = 0;
+        int c;
+
+        if (deadline >= 0) {
+                int64_t rel = deadline - clock_get_ns();
+                if (rel < 0) {
+                        rel = 0;
+                }
+                /* round up, or we'd spin for the last millisecond */
+                timeout = (int)((rel + 999999) / 1000000);
+        }
+
+        if (0 > poll(fds, nfds, timeout)) {
+                return -1;
+        }
+        for (c = 0; c < nfds && nevents < maxEvents; c++) {
+                if (!fds[c].revents) {
+                        continue;
+                }
+                events[nevents].fd = fds[c].fd;
+                events[nevents].events = 0;
+                if (fds[c].revents & (POLLIN | POLLHUP)) {
+                        events[nevents].events |= EVENT_READ;
+                }
+                if (fds[c].revents & (POLLERR | POLLNVAL)) {
+                        events[nevents].events |= EVENT_ERROR;
+                }
+                nevents++;
+        }
+        return nevents;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
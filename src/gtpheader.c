@@ -0,0 +1,479 @@
+/** gtping/gtpheader.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Encode and decode GTPv1 and GTPv2 headers, byte by byte.
+ *
+ * The first octet is flags, with the version in the top three bits:
+ *   v1: version:3 PT:1 spare:1 E:1 S:1 PN:1
+ *   v2: version:3 P:1  T:1 spare:3
+ * Its top five bits decide where everything else is, so they index a
+ * table of layouts. Reading a header is then one length check and
+ * loads from fixed offsets, the same on every compiler and byte order.
+ *
+ * GTPv2 sequence numbers are 24 bits, but only the top 16 are used, like
+ * gtping always has.
+ *
+ * After the header come information elements (IEs). gtpIeNext() walks
+ * them in place. In GTPv2 they're all type, length, instance. In GTPv1
+ * types below 128 have no length field and a fixed size per type
+ * (gtpv1TvLen), so an unknown one ends the walk.
+ *
+ * GTPv1 with the E flag has a chain of extension headers between the
+ * header and the IEs. Each is a length in units of 4 bytes, contents,
+ * and the type of the next one (0 = last). The first type is the last
+ * byte of the header.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "gtping.h"
+
+enum {
+        GTP_LAYOUT_NONE,
+        GTP_LAYOUT_V1,
+        GTP_LAYOUT_V2,
+        GTP_LAYOUT_V2_TEID,
+};
+
+/* offsets are from start of header. 0 = not there */
+static const struct GtpLayout gtpLayouts[] = {
+        /* len              lenBase teid seq npdu next oddFlags */
+        { 0,                  0,  0,   0,  0,   0,   0 },
+        { GTP_HDRLEN_V1,      8,  4,   8,  10,  11,  GTPV1_FLAG_E },
+        { GTP_HDRLEN_V2,      4,  0,   4,  0,   0,   GTPV2_FLAG_P },
+        { GTP_HDRLEN_V2_TEID, 4,  4,   8,  0,   0,   GTPV2_FLAG_P },
+};
+
+/* layout by top five bits of the flags octet: version, and PT and spare
+ * or P and T */
+static const unsigned char gtpLayoutOf[32] = {
+        /* version 0 */
+        GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE,
+        /* version 1, any PT and spare */
+        GTP_LAYOUT_V1, GTP_LAYOUT_V1, GTP_LAYOUT_V1, GTP_LAYOUT_V1,
+        /* version 2, P and T */
+        GTP_LAYOUT_V2, GTP_LAYOUT_V2_TEID, GTP_LAYOUT_V2, GTP_LAYOUT_V2_TEID,
+        /* version 3-7 */
+        GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE,
+        GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE,
+        GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE,
+        GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE,
+        GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE, GTP_LAYOUT_NONE,
+};
+
+/* GTPv1 TV IE value lengths, 3GPP TS 29.060 table 37. 0 = unknown */
+static const unsigned char gtpv1TvLen[128] = {
+        [1] = 1,   /* cause */
+        [2] = 8,   /* IMSI */
+        [3] = 6,   /* RAI */
+        [4] = 4,   /* TLLI */
+        [5] = 4,   /* P-TMSI */
+        [8] = 1,   /* reordering required */
+        [9] = 28,  /* authentication triplet */
+        [11] = 1,  /* MAP cause */
+        [12] = 3,  /* P-TMSI signature */
+        [13] = 1,  /* MS validated */
+        [14] = 1,  /* recovery */
+        [15] = 1,  /* selection mode */
+        [16] = 4,  /* TEID data I */
+        [17] = 4,  /* TEID control plane */
+        [18] = 5,  /* TEID data II */
+        [19] = 1,  /* teardown ind */
+        [20] = 1,  /* NSAPI */
+        [21] = 1,  /* RANAP cause */
+        [22] = 9,  /* RAB context */
+        [23] = 1,  /* radio priority SMS */
+        [24] = 1,  /* radio priority */
+        [25] = 2,  /* packet flow id */
+        [26] = 2,  /* charging characteristics */
+        [27] = 2,  /* trace reference */
+        [28] = 2,  /* trace type */
+        [29] = 1,  /* MS not reachable reason */
+        [127] = 4, /* charging ID */
+};
+
+/**
+ *
+ */
+static unsigned int
+get16(const unsigned char *p)
+{
+        return (p[0] << 8) | p[1];
+}
+
+/**
+ *
+ */
+static uint32_t
+get32(const unsigned char *p)
+{
+        return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**
+ *
+ */
+static void
+put16(unsigned char *p, unsigned int v)
+{
+        p[0] = v >> 8;
+        p[1] = v;
+}
+
+/**
+ *
+ */
+static void
+put32(unsigned char *p, uint32_t v)
+{
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+}
+
+/**
+ * Layout of header starting with flags octet 'flags'. len is 0 if the
+ * version is unknown.
+ */
+const struct GtpLayout*
+gtpLayout(unsigned int flags)
+{
+        return &gtpLayouts[gtpLayoutOf[(flags >> 3) & 0x1f]];
+}
+
+/**
+ * Write header 'h' to buf, which must have room for GTP_HDRLEN_MAX bytes.
+ * h->flags is the whole flags octet except the version.
+ *
+ * return header length, or 0 if h->version is unknown.
+ */
+size_t
+gtpEncode(unsigned char *buf, const struct GtpHeader *h)
+{
+        unsigned int flags = (h->version << 5) | (h->flags & 0x1f);
+        const struct GtpLayout *l = gtpLayout(flags);
+
+        if (!l->len) {
+                return 0;
+        }
+        memset(buf, 0, l->len);
+        buf[0] = flags;
+        buf[1] = h->msg;
+        put16(buf + 2, h->len);
+        if (l->teidOff) {
+                put32(buf + l->teidOff, h->teid);
+        }
+        put16(buf + l->seqOff, h->seq);
+        if (l->npduOff) {
+                buf[l->npduOff] = h->npdu;
+                buf[l->nextOff] = h->next;
+        }
+        return l->len;
+}
+
+/**
+ * Read GTP header from the start of packet into h. h->ok is set if
+ * packet was long enough for the header.
+ *
+ * return header length for this version and flags, or 0 if packet is
+ * empty or of unknown version.
+ */
+size_t
+gtpDecode(const void *packet, size_t packetlen, struct GtpHeader *h)
+{
+        const unsigned char *p = packet;
+        const struct GtpLayout *l;
+        unsigned int flags;
+        size_t end;
+
+        memset(h, 0, sizeof(struct GtpHeader));
+        if (!packetlen) {
+                return 0;
+        }
+        flags = p[0];
+        h->version = flags >> 5;
+        h->flags = flags & 0x1f;
+        l = gtpLayout(flags);
+        if (packetlen < l->len || !l->len) {
+                return l->len;
+        }
+
+        h->ok = 1;
+        h->msg = p[1];
+        h->len = get16(p + 2);
+        end = l->lenBase + h->len;
+        if (end > packetlen) {
+                end = packetlen;
+        }
+        if (end < l->len) {
+                end = l->len;
+        }
+        h->ieOff = l->len;
+        h->has_seq = h->version == 2 || (flags & GTPV1_FLAG_S);
+        h->seq = get16(p + l->seqOff);
+        h->has_teid = !!l->teidOff;
+        h->teid = l->teidOff ? get32(p + l->teidOff) : 0;
+        if (l->npduOff) {
+                h->has_npdu = flags & GTPV1_FLAG_PN;
+                h->npdu = p[l->npduOff];
+                h->has_ext_head = flags & GTPV1_FLAG_E;
+                h->next = p[l->nextOff];
+        }
+        if (h->has_ext_head) {
+                unsigned int next = h->next;
+                while (next) {
+                        size_t extLen;
+                        if (h->ieOff >= end
+                            || !(extLen = p[h->ieOff] * 4)
+                            || extLen > end - h->ieOff) {
+                                h->badExt = 1;
+                                h->ieOff = end;
+                                break;
+                        }
+                        h->ieOff += extLen;
+                        next = p[h->ieOff - 1];
+                }
+        }
+        h->ieLen = end - h->ieOff;
+        return l->len;
+}
+
+/**
+ * Set length field of the message in buf, which is 'msglen' bytes in all.
+ */
+void
+gtpSetLength(unsigned char *buf, size_t msglen)
+{
+        put16(buf + 2, msglen - gtpLayout(buf[0])->lenBase);
+}
+
+/**
+ * Write extension header with 'len' bytes of content to buf, padded to a
+ * multiple of 4 bytes, as the last in the chain. The caller links it in
+ * by putting its type in the previous next-type byte.
+ *
+ * return bytes written, or 0 if content is too long.
+ */
+size_t
+gtpPutExt(unsigned char *buf, const void *content, size_t len)
+{
+        size_t units = (len + 2 + 3) / 4;
+
+        if (units > 255) {
+                return 0;
+        }
+        memset(buf, 0, units * 4);
+        buf[0] = units;
+        memcpy(buf + 1, content, len);
+        return units * 4;
+}
+
+/**
+ * Write IE to buf. For GTPv1 TV types 'len' must be the size of the type.
+ * If value is NULL the IE is filled with zeros.
+ *
+ * return bytes written.
+ */
+size_t
+gtpPutIe(unsigned char *buf, int version, unsigned int type,
+         const void *value, size_t len)
+{
+        size_t hdr;
+
+        buf[0] = type;
+        if (version == 1 && type < 128) {
+                hdr = 1;
+        } else if (version == 1) {
+                put16(buf + 1, len);
+                hdr = 3;
+        } else {
+                put16(buf + 1, len);
+                buf[3] = 0; /* instance */
+                hdr = 4;
+        }
+        if (value) {
+                memcpy(buf + hdr, value, len);
+        } else {
+                memset(buf + hdr, 0, len);
+        }
+        return hdr + len;
+}
+
+/**
+ * Start walking the 'len' bytes of IEs at 'ies'.
+ */
+void
+gtpIeStart(struct GtpIeIter *it, int version, const void *ies, size_t len)
+{
+        it->version = version;
+        it->p = ies;
+        it->end = it->p + len;
+}
+
+/**
+ * Get next IE.
+ *
+ * return 1 if there was one, 0 at the end, or -1 if the rest can't be
+ *        parsed.
+ */
+int
+gtpIeNext(struct GtpIeIter *it, struct GtpIe *ie)
+{
+        size_t left = it->end - it->p;
+        size_t hdr;
+
+        if (!left) {
+                return 0;
+        }
+        ie->type = it->p[0];
+        ie->instance = 0;
+        if (it->version == 1 && ie->type < 128) {
+                hdr = 1;
+                ie->len = gtpv1TvLen[ie->type];
+                if (!ie->len) {
+                        return -1;
+                }
+        } else if (it->version == 1
+                   && ie->type == GTPV1_IE_EXTHDRLIST) {
+                /* the one TLV with a 1 byte length */
+                hdr = 2;
+                if (left < hdr) {
+                        return -1;
+                }
+                ie->len = it->p[1];
+        } else if (it->version == 1) {
+                hdr = 3;
+                if (left < hdr) {
+                        return -1;
+                }
+                ie->len = get16(it->p + 1);
+        } else {
+                hdr = 4;
+                if (left < hdr) {
+                        return -1;
+                }
+                ie->len = get16(it->p + 1);
+                ie->instance = it->p[3] & 0x0f;
+        }
+        if (left - hdr < ie->len) {
+                return -1;
+        }
+        ie->value = it->p + hdr;
+        it->p += hdr + ie->len;
+        return 1;
+}
+
+/**
+ * Find Recovery IE among 'len' bytes of IEs.
+ *
+ * return restart counter, -1 if there's no Recovery IE, or -2 if the IEs
+ *        before it are malformed.
+ */
+int
+gtpRecovery(int version, const void *ies, size_t len)
+{
+        unsigned int type = version == 1
+                ? GTPV1_IE_RECOVERY : GTPV2_IE_RECOVERY;
+        struct GtpIeIter it;
+        struct GtpIe ie;
+        int err;
+
+        gtpIeStart(&it, version, ies, len);
+        while (0 < (err = gtpIeNext(&it, &ie))) {
+                if (ie.type == type && ie.instance == 0 && ie.len >= 1) {
+                        return ie.value[0];
+                }
+        }
+        return err ? -2 : -1;
+}
+
+/**
+ * Decode headers of received packets pkts[0..n-1] into b. Anything odd
+ * about a packet is counted in anomalies[GTP_ANOMALY_*] instead of
+ * printed, so a flood of junk can't flood the terminal.
+ *
+ * Nearly all packets are echo replies whose length field is right.
+ * Those take one pass through the layout table, one combined compare
+ * and a walk over their IEs, which is normally just the Recovery IE.
+ */
+void
+gtpDecodeBatch(const struct RecvPacket *pkts, int n, struct GtpBatch *b,
+               unsigned int *anomalies)
+{
+        int c;
+
+        for (c = 0; c < n; c++) {
+                const unsigned char *p = (const unsigned char*)pkts[c].data;
+                size_t len = pkts[c].len;
+                const struct GtpLayout *l;
+                struct GtpHeader h;
+                size_t hdrlen;
+                int rec;
+
+                l = gtpLayout(len ? p[0] : 0);
+                if (len >= l->len && l->len
+                    && ((p[0] & l->oddFlags)
+                        | (p[1] ^ GTPMSG_ECHOREPLY)
+                        | ((l->lenBase + get16(p + 2)) ^ len)) == 0) {
+                        b->valid[c] = 1;
+                        b->version[c] = p[0] >> 5;
+                        b->msg[c] = p[1];
+                        b->seq[c] = get16(p + l->seqOff);
+                        b->teid[c] = l->teidOff ? get32(p + l->teidOff) : 0;
+                        rec = gtpRecovery(b->version[c],
+                                          p + l->len, len - l->len);
+                        if (rec == -2) {
+                                anomalies[GTP_ANOMALY_IE]++;
+                        }
+                        b->recovery[c] = rec < 0 ? -1 : rec;
+                        continue;
+                }
+
+                /* slow path: find out what's wrong with it */
+                hdrlen = gtpDecode(p, len, &h);
+                b->valid[c] = h.ok;
+                b->version[c] = h.version;
+                b->msg[c] = h.msg;
+                b->seq[c] = h.seq;
+                b->teid[c] = h.teid;
+                b->recovery[c] = -1;
+                if (!hdrlen) {
+                        anomalies[len
+                                  ? GTP_ANOMALY_VERSION
+                                  : GTP_ANOMALY_SHORT]++;
+                        continue;
+                }
+                if (!h.ok) {
+                        anomalies[GTP_ANOMALY_SHORT]++;
+                        continue;
+                }
+                if (h.msg != GTPMSG_ECHOREPLY
+                    && h.msg != GTPMSG_ERRORIND
+                    && h.msg != GTPMSG_SUPPEXTHDR) {
+                        anomalies[GTP_ANOMALY_MSG]++;
+                }
+                if (h.version == 2 && (h.flags & GTPV2_FLAG_P)) {
+                        /* piggybacked message is not looked at */
+                        anomalies[GTP_ANOMALY_PIGGYBACK]++;
+                } else if ((size_t)(l->lenBase + h.len) != len) {
+                        anomalies[GTP_ANOMALY_LENGTH]++;
+                }
+                rec = gtpRecovery(h.version, p + h.ieOff, h.ieLen);
+                if (rec == -2 || h.badExt) {
+                        anomalies[GTP_ANOMALY_IE]++;
+                }
+                b->recovery[c] = rec < 0 ? -1 : rec;
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -36,10 +36,10 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <time.h>
-#include <poll.h>
 #include <math.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <assert.h>
 #include <arpa/inet.h>
@@ -60,11 +60,6 @@
 #define SOL_IPV6 IPPROTO_IPV6
 #endif
 
-/* pings older than TRACKPINGS_SIZE * the_wait_time are ignored.
- * They are old and are considered lost.
- */
-#define TRACKPINGS_SIZE 1000
-
 /* For those OSs that don't read RFC3493, even though their manpage
  * points to it. */
 #ifndef AI_ADDRCONFIG
@@ -73,20 +68,34 @@
 
 static const char *version = PACKAGE_VERSION;
 
+/**
+ * A sent ping whose send lag is not counted yet. See noteSendLag().
+ */
+struct PendingLag {
+        struct Target *t;
+        unsigned int seq;
+        int64_t due;                 /* when it should have been sent */
+};
+
 static volatile sig_atomic_t sigintReceived = 0;
-static unsigned int curSeq = 0;
-static double startTime;
-static double sendTimes[TRACKPINGS_SIZE]; /* RTT data*/
-static int gotIt[TRACKPINGS_SIZE];        /* duplicate-check scratchpad  */
-static unsigned int totalTimeCount = 0;
-static double totalTime = 0;
-static double totalTimeSquared = 0;
-static double totalMin = -1;
-static double totalMax = -1;
-static unsigned int dups = 0;
-static unsigned int reorder = 0;
-static unsigned int highestSeq = 0;
-static unsigned int connectionRefused = 0;
+static int64_t startTime;
+static THREADLOCAL struct TargetTable targets;
+static THREADLOCAL unsigned int connectionRefused = 0;
+static int resolverFdAdded = 0;
+static THREADLOCAL int useBatchio = 0;
+static THREADLOCAL struct Stats sendLag; /* sent how long after scheduled */
+static THREADLOCAL struct PendingLag pendingLag[SENDLAG_PENDING];
+static THREADLOCAL unsigned int numPendingLag = 0;
+static int (*wakePipes)[2] = NULL; /* one per -j worker, for signals */
+static size_t numWakePipes = 0;
+static THREADLOCAL int wakeFd = -1; /* this worker's end */
+static volatile sig_atomic_t reportRequests = 0; /* SIGQUIT and SIGUSR1 */
+static THREADLOCAL sig_atomic_t reportsDone = 0;
+static THREADLOCAL int64_t interimStart;  /* current interim report window */
+static THREADLOCAL int64_t nextReportTime;
+static THREADLOCAL unsigned int anomalies[GTP_ANOMALIES]; /* odd packets */
+static THREADLOCAL unsigned int anomaliesShown[GTP_ANOMALIES];
+static THREADLOCAL int64_t anomaliesShownTime;
 
 /* from cmdline */
 const char *argv0 = 0;
@@ -101,11 +110,10 @@ struct Options options = {
         interval: -1,  /* -i <time> */
         
         wait: -1,      /* -w <time> */
-        autowait: 0,   /* 0 = -w not used, continuously update options.wait  */
+        autowait: 0,   /* 0 = -w not used, continuously update t->wait  */
+        report: 0,     /* -R <time> */
 
         count: 0,      /* -c, 0 is infinite */
-        target: 0,     /* arg */
-        targetip: 0,   /* resolved arg */
         ttl: -1,       /* -T <ttl> */
         tos: -1,       /* -Q <dscp> */
         has_teid: 0,   /* -t <teid> */
@@ -116,8 +124,20 @@ struct Options options = {
         source:      NULL,  /* -s <source if or addr> */
         source_port: "0",   /* -P <num> */
 
+        targetlist: NULL, /* -L <file> */
+
         traceroute: 0, /* -r */
         traceroutehops: DEFAULT_TRACEROUTEHOPS,  /* -r[<# per hop>] */
+
+        threads: 1, /* -j <threads> */
+
+        sketch: 0, /* -A <accuracy> */
+
+        gtpu: 0,       /* -u */
+        firstExt: 0,   /* -e <type>[:<hex>] */
+        ext: 0,
+        extLen: 0,
+        padTo: 0,      /* -z <size> */
 };
 
 static const char *dscpTable[][2] = {
@@ -289,6 +309,21 @@ bindSocket(int fd, const struct addrinfo *dest)
         }
 }
 
+/**
+ * Make -j workers look at the signal flags now, and not when their next
+ * timer is up. Called from signal handlers.
+ */
+static void
+wakeWorkers()
+{
+        size_t c;
+
+        for (c = 0; c < numWakePipes; c++) {
+                if (write(wakePipes[c][1], "", 1)) {
+                }
+        }
+}
+
 /**
  * callback function for SIGINT. Will terminate the mainloop.
  */
@@ -297,44 +332,54 @@ sigint(int unused)
 {
 	unused = unused; /* silence warning */
 	sigintReceived = 1;
+        wakeWorkers();
 }
 
 /**
- * Create socket and "connect" it to target
- * allocates and sets options.targetip
+ * callback function for SIGQUIT and SIGUSR1. Asks for an interim report.
+ */
+static void
+sigreport(int unused)
+{
+	unused = unused; /* silence warning */
+        reportRequests++;
+        wakeWorkers();
+}
+
+/**
+ * Resolve t->target and fill in t->addr, t->addrlen and t->targetip.
+ * If numericOnly is set then don't ask DNS, and quietly return 1 if
+ * t->target is not a numeric address.
  *
- * return fd, or <0 (-errno) on error
+ * Called from resolver threads, so only touch 't'.
+ *
+ * return 0 on success, 1 if not numeric, <0 (-errno) on error
  */
-static int
-setupSocket()
+int
+resolveTarget(struct Target *t, int numericOnly)
 {
-	int fd = -1;
 	int err = 0;
 	struct addrinfo *addrs = 0;
 	struct addrinfo hints;
-
-	if (options.verbose > 2) {
-		fprintf(stderr, "%s: setupSocket(%s)\n",
-			argv0, options.target);
-	}
-	if (!(options.targetip = malloc(NI_MAXHOST))) {
-		err = errno;
-		fprintf(stderr, "%s: malloc(NI_MAXHOST): %s\n",
-			argv0, strerror(err));
-		goto errout;
-	}
+	char host[NI_MAXHOST];
 
 	/* resolve to sockaddr */
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_flags = AI_ADDRCONFIG;
+	if (numericOnly) {
+		hints.ai_flags |= AI_NUMERICHOST;
+	}
 	hints.ai_family = options.af;
 	hints.ai_socktype = SOCK_DGRAM;
-	if (0 > (err = getaddrinfo(options.target,
-				   options.port,
+	if (0 > (err = getaddrinfo(t->target,
+				   t->port ? t->port : options.port,
 				   &hints,
 				   &addrs))) {
 		int gai_err;
 		gai_err = err;
+		if (numericOnly && gai_err == EAI_NONAME) {
+			return 1;
+		}
 		if (gai_err == EAI_SYSTEM) {
 			err = errno;
 		} else {
@@ -342,19 +387,19 @@ setupSocket()
 		}
 		if (gai_err == EAI_NONAME) {
 			fprintf(stderr, "%s: unknown host %s\n",
-				argv0, options.target);
+				argv0, t->target);
 			err = EINVAL;
 			goto errout;
 		}
                 fprintf(stderr, "%s: getaddrinfo(%s): %s\n",
-                        argv0, options.target, gai_strerror(gai_err));
+                        argv0, t->target, gai_strerror(gai_err));
 		goto errout;
 	}
 
-	/* get ip address string options.targetip */
+	/* get ip address string t->targetip */
 	if ((err = getnameinfo(addrs->ai_addr,
 			       addrs->ai_addrlen,
-			       options.targetip,
+			       host,
 			       NI_MAXHOST,
 			       NULL, 0,
 			       NI_NUMERICHOST))) {
@@ -369,12 +414,46 @@ setupSocket()
 			argv0,	gai_strerror(gai_err));
 		goto errout;
 	}
+	if (!(t->targetip = strdup(host))) {
+		err = errno;
+		fprintf(stderr, "%s: strdup(): %s\n",
+			argv0, strerror(err));
+		goto errout;
+	}
 	if (options.verbose > 1) {
 		fprintf(stderr, "%s: target=<%s> targetip=<%s>\n",
 			argv0,
-			options.target,
-			options.targetip);
+			t->target,
+			t->targetip);
+	}
+
+	memcpy(&t->addr, addrs->ai_addr, addrs->ai_addrlen);
+	t->addrlen = addrs->ai_addrlen;
+
+	freeaddrinfo(addrs);
+	return 0;
+ errout:
+	if (addrs) {
+		freeaddrinfo(addrs);
+	}
+	if (err == 0) {
+		err = EINVAL;
 	}
+	return -err;
+}
+
+/**
+ * Create socket, set socket options and bind it.
+ * 'addrs' only says what kind of socket to create. It's not connected.
+ * tos is the ToS/traffic class to set, or -1 for system default.
+ *
+ * return fd, or <0 (-errno) on error
+ */
+static int
+newSocket(const struct addrinfo *addrs, int tos)
+{
+	int fd = -1;
+	int err = 0;
 
 	/* socket() */
 	if (0 > (fd = socket(addrs->ai_family,
@@ -387,9 +466,15 @@ setupSocket()
 			addrs->ai_socktype,
 			addrs->ai_protocol,
 			strerror(err));
-		goto errout;
+		return -err;
 	}
 
+        /* main loops read until EAGAIN */
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+                fprintf(stderr, "%s: fcntl(%d, O_NONBLOCK): %s\n",
+                        argv0, fd, strerror(errno));
+        }
+
         errInspectionInit(fd, addrs);
 
         bindSocket(fd, addrs);
@@ -408,15 +493,15 @@ setupSocket()
 					strerror(errno));
 			}
 		}
-		if (options.tos >= 0) {
+		if (tos >= 0) {
 			if (setsockopt(fd,
 				       SOL_IP,
 				       IP_TOS,
-				       &options.tos,
-				       sizeof(options.tos))) {
+				       &tos,
+				       sizeof(tos))) {
 				fprintf(stderr,
 					"%s: setsockopt(%d, SOL_IP, IP_TOS, "
-					"%d): %s\n", argv0, fd, options.tos,
+					"%d): %s\n", argv0, fd, tos,
 					strerror(errno));
 			}
 		}
@@ -464,7 +549,7 @@ setupSocket()
 			}
 #endif
 		}
-		if (options.tos >= 0) {
+		if (tos >= 0) {
 #ifndef IPV6_TCLASS
                         fprintf(stderr,
                                 "%s: Setting traffic class on IPv6 "
@@ -473,12 +558,12 @@ setupSocket()
 			if (setsockopt(fd,
 				       SOL_IPV6,
 				       IPV6_TCLASS,
-				       &options.tos,
-				       sizeof(options.tos))) {
+				       &tos,
+				       sizeof(tos))) {
 				fprintf(stderr,
 					"%s: setsockopt(%d, SOL_IPV6, "
                                         "IPV6_TCLASS, %d): %s\n",
-                                        argv0, fd, options.tos,
+                                        argv0, fd, tos,
 					strerror(errno));
 			}
 #endif
@@ -509,118 +594,419 @@ setupSocket()
 #endif
 	}
 
+        /* have the kernel timestamp replies when they arrive, so RTT
+         * doesn't include how long it took us to get around to reading
+         * them */
+        {
+                int on = 1;
+#if defined(SO_TIMESTAMPNS)
+                if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS,
+                               &on, sizeof(on))) {
+                        fprintf(stderr, "%s: setsockopt(%d, SOL_SOCKET, "
+                                "SO_TIMESTAMPNS, on): %s\n",
+                                argv0, fd, strerror(errno));
+                }
+#elif defined(SO_TIMESTAMP)
+                if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP,
+                               &on, sizeof(on))) {
+                        fprintf(stderr, "%s: setsockopt(%d, SOL_SOCKET, "
+                                "SO_TIMESTAMP, on): %s\n",
+                                argv0, fd, strerror(errno));
+                }
+#else
+                on = on;
+#endif
+        }
+
+	return fd;
+}
+
+/**
+ * Length of echo request of GTP 'version', with or without TEID. GTPv1
+ * ones also have the -e extension headers and -z padding.
+ */
+static size_t
+echoLen(unsigned int version, int has_teid)
+{
+        size_t len;
+
+        if (version == 2) {
+                return (has_teid ? GTP_HDRLEN_V2_TEID : GTP_HDRLEN_V2)
+                        + GTPV2_IELEN_RECOVERY;
+        }
+        len = GTP_HDRLEN_V1 + options.extLen;
+        if (options.padTo > len) {
+                if (options.padTo < len + GTPV1_IELEN_PRIVATE_MIN) {
+                        return len + GTPV1_IELEN_PRIVATE_MIN;
+                }
+                return options.padTo;
+        }
+        return len;
+}
+
+/**
+ * Build the echo request for target once, when it's set up. sendEcho()
+ * then only fills in the sequence number, so sending doesn't allocate or
+ * rebuild anything.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+static int
+mkping(struct Target *t)
+{
+        /* gtping keeps no state worth telling peers about a restart of */
+        static const unsigned char restartCounter = 0;
+        struct GtpHeader h;
+        size_t alloc;
+        size_t len;
+
+        memset(&h, 0, sizeof(h));
+        h.version = t->version;
+        h.msg = GTPMSG_ECHO;
+        switch (t->version) {
+        case 1:
+                /* GTP, as opposed to GTP', and turn on sequence numbers.
+                 * TEID is always there in v1 */
+                h.flags = GTPV1_FLAG_PT | GTPV1_FLAG_S;
+                h.teid = t->has_teid ? t->teid : 0;
+                if (options.extLen) {
+                        h.flags |= GTPV1_FLAG_E;
+                        h.next = options.firstExt;
+                }
+                break;
+        case 2:
+                if (t->has_teid) {
+                        h.flags = GTPV2_FLAG_T;
+                        h.teid = t->teid;
+                }
+                break;
+        default:
+                fprintf(stderr,
+                        "%s: internal error, bad version %d\n",
+                        argv0, t->version);
+                exit(1);
+        }
+
+        alloc = echoLen(t->version, t->has_teid);
+        free(t->packet);
+        if (!(t->packet = malloc(alloc))) {
+                return -errno;
+        }
+        len = gtpEncode(t->packet, &h);
+        if (t->version == 2) {
+                /* mandatory in GTPv2 echo request. In GTPv1 only the
+                 * response has it */
+                len += gtpPutIe(t->packet + len, 2, GTPV2_IE_RECOVERY,
+                                &restartCounter, 1);
+        } else {
+                memcpy(t->packet + len, options.ext, options.extLen);
+                len += options.extLen;
+                if (alloc > len) {
+                        /* pad with a Private Extension IE */
+                        len += gtpPutIe(t->packet + len, 1, GTPV1_IE_PRIVATE,
+                                        NULL, alloc - len - 3);
+                }
+        }
+        gtpSetLength(t->packet, len);
+        t->packetLen = len;
+        t->packetSeqOff = gtpLayout(t->packet[0])->seqOff;
+        return 0;
+}
+
+/**
+ * Put sequence number in the target's prebuilt echo request.
+ */
+static void
+setPingSeq(struct Target *t, unsigned int seq)
+{
+        t->packet[t->packetSeqOff] = seq >> 8;
+        t->packet[t->packetSeqOff + 1] = seq;
+}
+
+/**
+ * Create socket and "connect" it to target
+ * sets t->fd, t->addr and allocates and sets t->targetip
+ *
+ * return fd, or <0 (-errno) on error
+ */
+static int
+setupSocket(struct Target *t)
+{
+	int fd = -1;
+	int err = 0;
+	struct addrinfo ai;
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: setupSocket(%s)\n",
+			argv0, t->target);
+	}
+
+	if ((err = resolveTarget(t, 0))) {
+		return err;
+	}
+
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family = t->addr.ss_family;
+	ai.ai_socktype = SOCK_DGRAM;
+	ai.ai_protocol = IPPROTO_UDP;
+	ai.ai_addr = (struct sockaddr*)&t->addr;
+	ai.ai_addrlen = t->addrlen;
+
+	if (0 > (fd = newSocket(&ai, t->tos))) {
+		return fd;
+	}
+
 	/* connect() */
 	if (connect(fd,
-		    addrs->ai_addr,
-		    addrs->ai_addrlen)) {
+		    (struct sockaddr*)&t->addr,
+		    t->addrlen)) {
 		err = errno;
 		fprintf(stderr, "%s: connect(%d, ...): %s\n",
 			argv0, fd, strerror(err));
 		close(fd);
-		goto errout;
+		return -err;
 	}
 
-	freeaddrinfo(addrs);
+	t->fd = fd;
+	t->connected = 1;
+        if ((err = mkping(t))) {
+		fprintf(stderr, "%s: mkping(): %s\n", argv0, strerror(-err));
+                return err;
+        }
 	return fd;
- errout:
-	if (addrs) {
-		freeaddrinfo(addrs);
-		addrs = 0;
-	}
-	if (options.targetip) {
-		free(options.targetip);
-		options.targetip = 0;
-	}
-	if (err == 0) {
-		err = -EINVAL;
-	}
-	if (fd >= 0) {
-		close(fd);
-		fd = -1;
-	}
-	if (err > 0) {
-		err = -err;
-	}
-	return err;
 }
 
 /**
+ * Sockets shared by all targets in multi-target mode. One per address
+ * family and ToS.
+ */
+struct MultiSocket {
+        int af;
+        int tos;
+        int fd;
+};
+static THREADLOCAL struct MultiSocket *multiSockets = 0;
+static THREADLOCAL size_t numMultiSockets = 0;
+
+/**
+ * Get the shared unconnected socket for address family 'af' and ToS 'tos',
+ * creating it on first use. Used when pinging many targets at once.
  *
+ * return fd, or <0 (-errno) on error
  */
-static size_t
-mkping_v1(int seq, void **packet)
+static int
+getMultiSocket(int af, int tos)
 {
-        struct GtpEchoV1 *gtp;
-        if (!(gtp = malloc(sizeof(struct GtpEchoV1)))) {
-                return -errno;
+        struct MultiSocket *p;
+        struct addrinfo ai;
+        size_t c;
+        int fd;
+
+        for (c = 0; c < numMultiSockets; c++) {
+                if (multiSockets[c].af == af && multiSockets[c].tos == tos) {
+                        return multiSockets[c].fd;
+                }
         }
 
-        *packet = gtp;
-
-        memset(gtp, 0, sizeof(struct GtpEchoV1));
-        gtp->version = options.version;
-        gtp->has_seq = 1;   /* turn on sequence numbers */
-        gtp->proto_type = 1; /* GTP, as opposed to GTP' */
-        gtp->msg = GTPMSG_ECHO;
-        gtp->len = htons(4);
-        if (options.teid >= 0) {
-                gtp->teid = htonl(options.teid);
-        } else {
-                gtp->teid = 0;
+        if (!(p = realloc(multiSockets,
+                          (numMultiSockets + 1) * sizeof(*p)))) {
+                fd = errno;
+                fprintf(stderr, "%s: realloc(): %s\n",
+                        argv0, strerror(fd));
+                return -fd;
+        }
+        multiSockets = p;
+
+        memset(&ai, 0, sizeof(ai));
+        ai.ai_family = af;
+        ai.ai_socktype = SOCK_DGRAM;
+        ai.ai_protocol = IPPROTO_UDP;
+        if (0 > (fd = newSocket(&ai, tos))) {
+                return fd;
+        }
+        if (!useBatchio || batchioAddSocket(fd)) {
+                /* not received through batchio, read it directly */
+                eventLoopAdd(fd, 1);
+                errInspectionTxTimestamps(fd);
         }
-        gtp->seq = htons(seq);
-        gtp->npdu = 0x00;
-        gtp->next = 0x00;
+        p = &multiSockets[numMultiSockets++];
+        p->af = af;
+        p->tos = tos;
+        p->fd = fd;
+        return fd;
+}
+
+/**
+ * Count how late the pings from noteSendLag() were sent. Batched sends
+ * are flushed first, since that's when they are actually sent.
+ */
+static void
+countSendLag()
+{
+        unsigned int c;
 
-        return sizeof(struct GtpEchoV1);
+        if (!numPendingLag) {
+                return;
+        }
+        if (useBatchio) {
+                batchioFlush();
+        }
+        for (c = 0; c < numPendingLag; c++) {
+                const struct PendingLag *p = &pendingLag[c];
+                statsAddRtt(&sendLag,
+                            *targetWindowSendTime(p->t, p->seq) - p->due);
+        }
+        numPendingLag = 0;
 }
 
 /**
- *
+ * Ping 'seq' to t, due at 'due', was just sent or queued. How late it
+ * was is counted by countSendLag().
  */
-static size_t
-mkping_v2(int seq, void **packet)
+static void
+noteSendLag(struct Target *t, unsigned int seq, int64_t due)
 {
-        struct GtpEchoV2 *gtp;
-        if (!(gtp = malloc(sizeof(struct GtpEchoV2)))) {
-                return -errno;
+        if (numPendingLag == SENDLAG_PENDING) {
+                countSendLag();
         }
+        pendingLag[numPendingLag].t = t;
+        pendingLag[numPendingLag].seq = seq;
+        pendingLag[numPendingLag].due = due;
+        numPendingLag++;
+}
 
-        *packet = gtp;
+/**
+ * Print how far off schedule pings were sent, if there was a schedule.
+ */
+static void
+printSendLag()
+{
+        if (sendLag.totalTimeCount) {
+                statsPrintTimes("send lag", &sendLag);
+                printf(", ");
+                statsPrintPercentiles("send lag", &sendLag);
+                printf("\n");
+        }
+}
 
-        memset(gtp, 0, sizeof(struct GtpEchoV2));
-        gtp->version = options.version;
-        gtp->msg = GTPMSG_ECHO;
+/**
+ * One line of interim report. Replies can be to pings sent in an earlier
+ * window, so there can be more replies than pings.
+ */
+static void
+printInterimLine(const char *name, const char *ip, const struct Stats *s,
+                 int64_t jitter)
+{
+        int loss = 0;
 
-        if (options.has_teid) {
-                gtp->len = htons(4); /* FIXME; 6? */
-                gtp->u2.s.teid = htonl(options.teid);
-                gtp->u2.s.seq = htons(seq);
-                gtp->has_teid = 1;
-                return GTPECHOv2_LEN_WITHOUT_TEID + 4;
+        if (s->sent > s->recvd) {
+                loss = (int)((100.0 * (s->sent - s->recvd)) / s->sent);
+        }
+        if (ip) {
+                printf("%s (%s): ", name, ip);
         } else {
-                gtp->len = 0; /* FIXME: 2? */
-                gtp->u2.seq = htons(seq);
-                return GTPECHOv2_LEN_WITHOUT_TEID;
+                printf("%s: ", name);
+        }
+        printf("%u transmitted, %u received, %d%% packet loss, "
+               "%u out of order, %u dups",
+               s->sent, s->recvd, loss, s->reorder, s->dups);
+        if (s->restarts) {
+                printf(", %u restarts", s->restarts);
+        }
+        if (s->errorInds) {
+                printf(", %u error indications", s->errorInds);
+        }
+        if (s->totalTimeCount) {
+                printf(", ");
+                statsPrintRtt(s);
+                printf(", ");
+                statsPrintPercentiles("rtt", s);
+                printf(", ");
+                statsPrintDelayVar(s, jitter);
         }
+        if (s->reorder || s->gaps) {
+                printf(", ");
+                statsPrintReorder(s);
+        }
+        if (s->loss.classifiedLost) {
+                printf(", ");
+                statsPrintLoss(s);
+        }
+        printf("\n");
+}
+
+/**
+ * Print what happened to this thread's targets since the last interim
+ * report, and start a new window.
+ */
+static void
+printInterimReport(int64_t now)
+{
+        struct Stats total;
+        int64_t jitterSum = 0;
+        unsigned int jitterCount = 0;
+        char date[64];
+        time_t t;
+        size_t c;
+
+        t = time(NULL);
+        if (!strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+                      localtime(&t))) {
+                strcpy(date, "?");
+        }
+
+        statsInit(&total);
+        flockfile(stdout);
+        printf("\n--- %s, last %.3f s ---\n",
+               date, (double)(now - interimStart) / NS_PER_SEC);
+        for (c = 0; c < targets.num; c++) {
+                struct Target *tg = targets.targets[c];
+                struct Stats *s;
+                int64_t jitter = targetJitter(tg);
+
+                targetLossAge(tg, tg->curSeq, tg->windowSize, now);
+                s = targetInterim(tg);
+                printInterimLine(tg->target, tg->targetip, s, jitter);
+                statsMerge(&total, s);
+                if (jitter >= 0) {
+                        jitterSum += jitter;
+                        jitterCount++;
+                }
+        }
+        if (targets.num > 1 && options.threads < 2) {
+                /* jitter of the total is the average of the targets' */
+                printInterimLine("total", NULL, &total,
+                                 jitterCount ? jitterSum / jitterCount : -1);
+        }
+        fflush(stdout);
+        funlockfile(stdout);
+        statsFree(&total);
+
+        targetInterimRotate();
+        interimStart = now;
 }
 
 /**
+ * Print interim report if -R time is up or SIGQUIT/SIGUSR1 asked for one.
  *
+ * return when the next -R report is due, or -1 if never.
  */
-static size_t
-mkping(int seq, void **packet)
+static int64_t
+checkInterimReport(int64_t now)
 {
-        switch (options.version) {
-        case 1:
-                return mkping_v1(seq, packet);
-        case 2:
-                return mkping_v2(seq, packet);
+        if (reportsDone != reportRequests) {
+                reportsDone = reportRequests;
+                printInterimReport(now);
+        } else if (options.report && now >= nextReportTime) {
+                printInterimReport(now);
         }
-        fprintf(stderr,
-                "%s: internal error, bad version %d\n",
-                argv0, options.version);
-        exit(1);
+        if (!options.report) {
+                return -1;
+        }
+        while (nextReportTime <= now) {
+                nextReportTime += options.report;
+        }
+        return nextReportTime;
 }
 
 /**
@@ -628,30 +1014,70 @@ mkping(int seq, void **packet)
  * failed (do increment sent counter)
  */
 static int
-sendEcho(int fd, int seq)
+sendEcho(struct Target *t, unsigned int seq)
 {
 	int err = 0;
-        void *packet = 0;
-        ssize_t packetlen;
+        const void *packet = t->packet;
+        ssize_t packetlen = t->packetLen;
+        ssize_t n;
+        int64_t *sendTime;
+        int64_t now;
+        unsigned int size;
+        unsigned int keep;
 
 	if (options.verbose > 2) {
-		fprintf(stderr, "%s: sendEcho(%d, %d)\n", argv0, fd, seq);
+		fprintf(stderr, "%s: sendEcho(%d, %u)\n", argv0, t->fd, seq);
 	}
 
-        if (0 > (packetlen = mkping(seq, &packet))) {
-                err = packetlen;
-                goto errout;
-        }
+        setPingSeq(t, seq);
 
 	if (options.verbose > 1) {
-		fprintf(stderr,	"%s: Sending GTP ping with seq=%d size %d\n",
-			argv0, curSeq, (int)packetlen);
+		fprintf(stderr,	"%s: Sending GTP ping to %s "
+                        "with seq=%u size %d\n",
+			argv0, t->targetip, seq, (int)packetlen);
 	}
 
-        sendTimes[seq % TRACKPINGS_SIZE] = clock_get_dbl();
-        gotIt[seq % TRACKPINGS_SIZE] = 0;
+        now = clock_get_ns();
+        size = targetWindowWant(t, seq, now);
 
-	if (packetlen != send(fd, packet, packetlen, 0)) {
+        /* pings whose slots are about to be reused are done, one way or
+         * the other */
+        keep = size - 1;
+        if (keep > t->windowSize) {
+                keep = t->windowSize;
+        }
+        targetLossAge(t, seq, keep, now);
+
+        if (size != t->windowSize) {
+                if (useBatchio) {
+                        /* queued sends point into the old window */
+                        batchioFlush();
+                }
+                if (options.verbose > 1) {
+                        fprintf(stderr, "%s: %s: tracking window %u -> %u\n",
+                                argv0, t->targetip, t->windowSize, size);
+                }
+                /* on failure, keep using the old one */
+                targetWindowResize(t, size, seq);
+        }
+        sendTime = targetWindowStart(t, seq);
+
+        if (useBatchio) {
+                /* send time is filled in when it's actually sent */
+                n = batchioSend(t->fd, packet, packetlen,
+                                t->connected
+                                ? NULL : (struct sockaddr*)&t->addr,
+                                t->addrlen,
+                                sendTime);
+        } else if (t->connected) {
+                *sendTime = clock_get_ns();
+                n = send(t->fd, packet, packetlen, 0);
+        } else {
+                *sendTime = clock_get_ns();
+                n = sendto(t->fd, packet, packetlen, 0,
+                           (struct sockaddr*)&t->addr, t->addrlen);
+        }
+	if (packetlen != n) {
 		err = errno;
 		if (err == ECONNREFUSED) {
                         printf("Connection refused\n");
@@ -659,12 +1085,11 @@ sendEcho(int fd, int seq)
                         goto errout;
 		}
                 fprintf(stderr, "%s: send(%d, ...): %s\n",
-                        argv0, fd, strerror(errno));
+                        argv0, t->fd, strerror(errno));
                 err = -err;
                 goto errout;
 	}
  errout:
-        free(packet);
 	return 0;
 }
 
@@ -718,260 +1143,207 @@ tos2String(int tos, char *buf, size_t buflen)
 }
 
 /**
- *
+ * Print how many odd packets were received since last time, at most once
+ * a second unless 'force'.
  */
-static struct GtpReply
-parseReply_v1(const void *packet, size_t packetlen)
+static void
+reportAnomalies(int force)
 {
-        struct GtpReply ret;
-        const struct GtpEchoV1 *gtp = packet;
-        memset(&ret, 0, sizeof(ret));
-        /* check packet size */
+        static const char *names[GTP_ANOMALIES] = {
+                "short",
+                "bad version",
+                "not echo reply",
+                "bad length",
+                "GTPv2 piggybacked",
+                "bad IEs",
+        };
+        const char *sep = "";
+        int64_t now;
+        int any = 0;
+        int c;
 
-        if (packetlen < sizeof(struct GtpEchoV1)) {
-                fprintf(stderr, "%s: Short GTPv1 packet received: %d < 12\n",
-                        argv0, (int)packetlen);
-                return ret;
+        for (c = 0; c < GTP_ANOMALIES; c++) {
+                any |= anomalies[c] != anomaliesShown[c];
         }
-
-        if (packetlen > sizeof(struct GtpEchoV1)) {
-                if (options.verbose) {
-                        printf("%s: Long packet received: %d < 12\n",
-                               argv0, (int)packetlen);
+        if (!any) {
+                return;
+        }
+        now = clock_get_ns();
+        if (!force && now - anomaliesShownTime < NS_PER_SEC) {
+                return;
+        }
+        fprintf(stderr, "%s: odd packets received: ", argv0);
+        for (c = 0; c < GTP_ANOMALIES; c++) {
+                if (anomalies[c] != anomaliesShown[c]) {
+                        fprintf(stderr, "%s%u %s", sep,
+                                anomalies[c] - anomaliesShown[c], names[c]);
+                        anomaliesShown[c] = anomalies[c];
+                        sep = ", ";
                 }
-                /* continue parsing packet... */
         }
-
-        ret.ok = 1;
-        ret.msg = gtp->msg;
-        ret.version = 1;
-
-        ret.has_seq = gtp->has_seq;
-        ret.seq = htons(gtp->seq);
-
-        ret.has_teid = 1;
-        ret.teid = htonl(gtp->teid);
-
-        ret.has_npdu = gtp->has_npdu;
-        ret.npdu = gtp->npdu;
-
-        ret.has_ext_head = gtp->has_ext_head;
-        ret.next = gtp->next;
-
-        return ret;
+        fprintf(stderr, "\n");
+        anomaliesShownTime = now;
 }
 
 /**
- *
+ * Print GTP-U Error Indication or Supported Extension Headers
+ * Notification from target t. They're rare, so they're decoded again
+ * here instead of in gtpDecodeBatch().
  */
-static struct GtpReply
-parseReply_v2(const void *packet, size_t packetlen)
+static void
+handleNotice(const struct RecvPacket *p, struct Target *t)
 {
-        struct GtpReply ret;
-        const struct GtpEchoV2 *gtp = packet;
-        size_t right_len = 0;
-
-        memset(&ret, 0, sizeof(ret));
-
-        /* shortest possible GTPv2 packet is 8 bytes */
-        if (packetlen < GTPECHOv2_LEN_WITHOUT_TEID) {
-                fprintf(stderr,
-                        "%s: Short GTPv2 packet received: %d < 8\n",
-                        argv0, (int)packetlen);
-                return ret;
-        }
-
-        if (gtp->has_teid) {
-                right_len = GTPECHOv2_LEN_WITHOUT_TEID + 4;
-        } else {
-                right_len = GTPECHOv2_LEN_WITHOUT_TEID;
-        }
-
-        if (gtp->piggyback) {
-                fprintf(stderr,
-                        "%s: Get GTP packet with piggyback flag "
-                        "unexpectedly set. "
-                        "Not parsing piggybacked data.",
-                        argv0);
-                if (packetlen > right_len) {
-                        packetlen = right_len;
+        struct GtpHeader h;
+        struct GtpIeIter it;
+        struct GtpIe ie;
+        unsigned int c;
+
+        gtpDecode(p->data, p->len, &h);
+        gtpIeStart(&it, h.version, p->data + h.ieOff, h.ieLen);
+        if (h.msg == GTPMSG_ERRORIND) {
+                char peer[INET6_ADDRSTRLEN] = "";
+                uint32_t teid = 0;
+
+                while (0 < gtpIeNext(&it, &ie)) {
+                        if (ie.type == GTPV1_IE_TEID_DATA) {
+                                for (c = 0; c < ie.len; c++) {
+                                        teid = (teid << 8) | ie.value[c];
+                                }
+                        } else if (ie.type == GTPV1_IE_PEERADDR
+                                   && (ie.len == 4 || ie.len == 16)) {
+                                inet_ntop(ie.len == 4 ? AF_INET : AF_INET6,
+                                          ie.value, peer, sizeof(peer));
+                        }
                 }
+                printf("From %s: Error Indication, TEID 0x%08x%s%s\n",
+                       t->targetip, teid, peer[0] ? ", peer " : "", peer);
+                t->stats.errorInds++;
+                targetInterim(t)->errorInds++;
+                return;
         }
 
-        if (packetlen != right_len) {
-                fprintf(stderr,
-                        "%s: GTPv2 packet length error: %d should be %d\n",
-                        argv0, (int)packetlen, (int)right_len);
-                if (packetlen < right_len) {
-                        return ret;
+        printf("From %s: Extension headers not supported:", t->targetip);
+        while (0 < gtpIeNext(&it, &ie)) {
+                if (ie.type != GTPV1_IE_EXTHDRLIST) {
+                        continue;
+                }
+                for (c = 0; c < ie.len; c++) {
+                        printf(" 0x%02x", ie.value[c]);
                 }
-                /* continue parsing long packets */
         }
-
-        ret.ok = 1;
-        ret.msg = gtp->msg;
-        ret.version = 2;
-        ret.has_seq = 1;
-
-        ret.has_teid = gtp->has_teid;
-        if (ret.has_teid) {
-                ret.teid = htonl(gtp->u2.s.teid);
-                ret.seq = htons(gtp->u2.s.seq);
-        } else {
-                ret.seq = htons(gtp->u2.seq);
-        }
-
-        return ret;
+        printf("\n");
 }
 
 /**
+ * Handle one received packet, p, whose header is number i in b.
  *
- */
-static struct GtpReply
-parseReply(const void *packet, size_t packetlen)
-{
-        const struct GtpEchoV1 *gtp; /* it's ok, we'll just check version */
-        struct GtpReply err;
-        err.ok = 0;
-
-        if (packetlen < 1) {
-                return err;
-        }
-
-        gtp = packet;
-
-        switch (gtp->version) {
-        case 1:
-                return parseReply_v1(packet, packetlen);
-        case 2:
-                return parseReply_v2(packet, packetlen);
-        }
-
-        fprintf(stderr,
-                "%s: Bad packet with version %d received\n",
-                argv0, gtp->version);
-        return err;
-}
-
-
-
-/**
- * return 0 on success/got reply,
- *        <0 on fail. Errno returned.
- *        >0 on success, but no packet (EINTR or dup packet)
+ * return 0 if it was a reply,
+ *        1 if not (dup, unknown sender or not an echo reply)
+ *
+ * If 'from' is not NULL it's set to the target the reply was for, or NULL
+ * if that's not known.
  */
 static int
-recvEchoReply(int fd)
+handleEchoReply(const struct RecvPacket *p, const struct GtpBatch *b, int i,
+                struct Target **from)
 {
-	int err;
-        char packet[1024];
-        ssize_t packetlen;
-	double now;
+        const struct sockaddr *sa = (const struct sockaddr*)&p->from;
+	int64_t now;
 	char lag[128];
         int isDup = 0;
         int isReorder = 0;
-        int ttl;
-        int tos;
         char tosString[128] = {0};
         char ttlString[128] = {0};
-        struct GtpReply gtp;
+        unsigned int seq;
+        struct Target *t;
+        struct Stats *stats;
+        struct Stats *interim;
 
-	if (options.verbose > 2) {
-		fprintf(stderr, "%s: recvEchoReply()\n", argv0);
-	}
+        if (from) {
+                *from = NULL;
+        }
 
-	now = clock_get_dbl();
-	
-	memset(packet, 0, sizeof(packet));
-        if (0 > (packetlen = doRecv(fd,
-                                    (void*)packet,
-                                    sizeof(packet),
-                                    &ttl,
-                                    &tos))) {
-		switch(errno) {
-                case ECONNREFUSED:
-                        connectionRefused++;
-			handleRecvErr(fd, "Port closed", 0);
-                        return 1;
-		case EINTR:
-                        return 1;
-                case EHOSTUNREACH:
-			handleRecvErr(fd, "Host unreachable or TTL exceeded",
-                                      0);
-                        return 1;
-		default:
-			err = errno;
-			fprintf(stderr, "%s: recv(%d, ...): %s\n",
-				argv0, fd, strerror(errno));
-                        return err;
-		}
-	}
+	now = p->time;
+
+        if (!(t = targetTableLookup(&targets, sa))) {
+                if (options.verbose) {
+                        char host[NI_MAXHOST];
+                        if (getnameinfo(sa, p->fromlen,
+                                        host, sizeof(host),
+                                        NULL, 0,
+                                        NI_NUMERICHOST)) {
+                                strcpy(host, "<unknown>");
+                        }
+                        fprintf(stderr,
+                                "%s: Ignoring packet from unknown host %s\n",
+                                argv0, host);
+                }
+                return 1;
+        }
+        stats = &t->stats;
+        interim = targetInterim(t);
+        if (from) {
+                *from = t;
+        }
 
         /* create ttl string */
-        if (0 <= ttl) {
-                snprintf(ttlString, sizeof(ttlString), "ttl=%d ", ttl);
+        if (0 <= p->ttl) {
+                snprintf(ttlString, sizeof(ttlString), "ttl=%d ", p->ttl);
         }
 
         /* create tos string */
-        if (0 <= tos) {
+        if (0 <= p->tos) {
                 char scratch[128];
                 snprintf(tosString, sizeof(tosString),
-                         "%s ", tos2String(tos,
+                         "%s ", tos2String(p->tos,
                                            scratch,
                                            sizeof(scratch)));
         }
 
-        gtp = parseReply(packet, packetlen);
-        if (!gtp.ok) {
+        if (b->valid[i] && (b->msg[i] == GTPMSG_ERRORIND
+                            || b->msg[i] == GTPMSG_SUPPEXTHDR)) {
+                handleNotice(p, t);
                 return 1;
         }
-
-	if (gtp.msg != GTPMSG_ECHOREPLY) {
-		fprintf(stderr,
-			"%s: Got non-EchoReply type of msg (type: %d)\n",
-			argv0, gtp.msg);
+        /* anything else is counted in anomalies[] */
+        if (!b->valid[i] || b->msg[i] != GTPMSG_ECHOREPLY) {
                 return 1;
-	}
+        }
 
-        if (curSeq - gtp.seq >= TRACKPINGS_SIZE) {
+        seq = targetSeqExtend(t, b->seq[i]);
+        if (!targetWindowHas(t, seq)) {
 		strcpy(lag, "Inf");
 	} else {
-                int pos = gtp.seq % TRACKPINGS_SIZE;
-                double lagf = now - sendTimes[pos];
-                if (gotIt[pos]) {
-                        isDup = 1;
-                }
-                gotIt[pos]++;
-		snprintf(lag, sizeof(lag), "%.2f ms", 1000 * lagf);
+                int64_t rtt = now - *targetWindowSendTime(t, seq);
+                isDup = targetWindowSetGotIt(t, seq);
+		snprintf(lag, sizeof(lag), "%.2f ms", NS2MS(rtt));
                 if (!isDup) {
-                        totalTime += lagf;
-                        totalTimeSquared += lagf * lagf;
-                        totalTimeCount++;
-                        if ((0 > totalMin) || (lagf < totalMin)) {
-                                totalMin = lagf;
-                        }
-                        if ((0 > totalMax) || (lagf > totalMax)) {
-                                totalMax = lagf;
-                        }
+                        statsAddRtt(stats, rtt);
+                        statsAddRtt(interim, rtt);
+                        targetAddDelayVar(t, seq, rtt);
+                        targetLossUndo(t, seq);
                 }
-                if (options.autowait) {
-                        options.wait = 2 * (totalTime / totalTimeCount);
+                /* each target by its own RTT, or a fast one would make
+                 * us give up on the slow ones */
+                if (options.autowait && stats->totalTimeCount) {
+                        t->wait = 2 * (stats->totalTime
+                                       / stats->totalTimeCount);
                         if (options.verbose > 1) {
                                 fprintf(stderr,
-                                        "%s: Adjusting waittime to %.6f\n",
-                                        argv0, options.wait);
+                                        "%s: %s: Adjusting waittime to "
+                                        "%.6f\n",
+                                        argv0, t->targetip,
+                                        (double)t->wait / NS_PER_SEC);
                         }
                 }
 	}
 
         /* detect packet reordering */
         if (!isDup) {
-                if (highestSeq > gtp.seq) {
-                        reorder++;
-                        isReorder = 1;
-                } else {
-                        highestSeq = gtp.seq;
-                }
+                struct ReorderSample rs;
+                isReorder = reorderAdd(&t->reorder, seq, now, &rs);
+                statsAddReorder(stats, &rs);
+                statsAddReorder(interim, &rs);
         }
 
         if (options.flood) {
@@ -980,54 +1352,278 @@ recvEchoReply(int fd)
                 }
         } else {
                 printf("%u bytes from %s: ver=%d seq=%u %s%stime=%s%s%s\n",
-                       (int)packetlen,
-                       options.targetip,
-                       gtp.version,
-                       gtp.seq,
+                       (int)p->len,
+                       t->targetip,
+                       b->version[i],
+                       seq,
                        tosString[0] ? tosString : "",
                        ttlString[0] ? ttlString : "",
                        lag,
                        isDup ? " (DUP)" : "",
                        isReorder ? " (out of order)" : "");
         }
+
+        /* a new restart counter in the Recovery IE means the peer lost
+         * its state. In GTP-U it's always 0 */
+        if (!options.gtpu && !isDup && b->recovery[i] >= 0) {
+                if (t->restartCounter >= 0
+                    && t->restartCounter != b->recovery[i]) {
+                        printf("%s (%s) restarted: restart counter "
+                               "%d -> %d\n",
+                               t->target, t->targetip,
+                               t->restartCounter, b->recovery[i]);
+                        stats->restarts++;
+                        interim->restarts++;
+                }
+                t->restartCounter = b->recovery[i];
+        }
+
         if (isDup) {
-                dups++;
+                stats->dups++;
+                interim->dups++;
         }
 	return isDup;
 }
 
+/**
+ * A transmit timestamp came back on the error queue, together with the
+ * packet that was sent: link, IP and UDP headers, then the GTP ping.
+ * Find the target and sequence number from the headers and use 'when' as
+ * the send time of that ping, unless its reply is already in.
+ */
+void
+handleTxTimestamp(const void *packet, size_t len, int64_t when)
+{
+        const size_t gtpLens[] = {
+                echoLen(1, 0),
+                echoLen(2, 0),
+                echoLen(2, 1),
+        };
+        const unsigned char *data = packet;
+        size_t c;
+
+        for (c = 0; c < sizeof(gtpLens)/sizeof(gtpLens[0]); c++) {
+                size_t gtpLen = gtpLens[c];
+                const unsigned char *udp;
+                unsigned int seq;
+                const unsigned char *ip;
+                struct sockaddr_storage ss;
+                struct GtpHeader gtp;
+                struct Target *t;
+
+                if (len < gtpLen + 8 + 20) {
+                        continue;
+                }
+                udp = data + len - gtpLen - 8;
+                if ((size_t)((udp[4] << 8) | udp[5]) != gtpLen + 8) {
+                        continue;
+                }
+
+                memset(&ss, 0, sizeof(ss));
+                if (len >= gtpLen + 8 + 40
+                    && ((ip = udp - 40)[0] >> 4) == 6
+                    && ip[6] == IPPROTO_UDP) {
+                        struct sockaddr_in6 *sin6 = (void*)&ss;
+                        sin6->sin6_family = AF_INET6;
+                        memcpy(&sin6->sin6_addr, ip + 24, 16);
+                        memcpy(&sin6->sin6_port, udp + 2, 2);
+                } else if (((ip = udp - 20)[0] >> 4) == 4
+                           && ip[9] == IPPROTO_UDP) {
+                        struct sockaddr_in *sin = (void*)&ss;
+                        sin->sin_family = AF_INET;
+                        memcpy(&sin->sin_addr, ip + 16, 4);
+                        memcpy(&sin->sin_port, udp + 2, 2);
+                } else {
+                        continue;
+                }
+                if (!(t = targetTableLookup(&targets,
+                                            (struct sockaddr*)&ss))) {
+                        continue;
+                }
+
+                gtpDecode(udp + 8, gtpLen, &gtp);
+                if (!gtp.ok || !gtp.has_seq) {
+                        return;
+                }
+                seq = targetSeqExtend(t, gtp.seq);
+                if (!targetWindowHas(t, seq)
+                    || targetWindowGotIt(t, seq)) {
+                        return;
+                }
+                if (options.verbose > 2) {
+                        fprintf(stderr, "%s: handleTxTimestamp(%s, %u): "
+                                "%.3f ms after send()\n",
+                                argv0, t->targetip, seq,
+                                NS2MS(when - *targetWindowSendTime(t, seq)));
+                }
+                *targetWindowSendTime(t, seq) = when;
+                return;
+        }
+}
+
+/**
+ * Read and handle everything that has arrived on fd, a batch at a time.
+ *
+ * return number of packets and receive errors read. *replies is set to
+ * how many of them were good replies.
+ */
+static int
+recvEchoReplies(int fd, int *replies)
+{
+        struct RecvPacket pkts[RECV_BATCH];
+        struct GtpBatch batch;
+        struct Target *t;
+        int total = 0;
+        int n;
+        int c;
+
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: recvEchoReplies(%d)\n", argv0, fd);
+	}
+
+        *replies = 0;
+        for (;;) {
+                if (0 > (n = doRecvBatch(fd, pkts, RECV_BATCH))) {
+                        switch(errno) {
+                        case ECONNREFUSED:
+                                connectionRefused++;
+                                handleRecvErr(fd, "Port closed", 0);
+                                total++;
+                                continue;
+                        case EINTR:
+                                continue;
+                        case EAGAIN:
+                                return total;
+                        case EHOSTUNREACH:
+                                handleRecvErr(fd,
+                                              "Host unreachable or TTL "
+                                              "exceeded",
+                                              0);
+                                total++;
+                                continue;
+                        default:
+                                fprintf(stderr, "%s: recv(%d, ...): %s\n",
+                                        argv0, fd, strerror(errno));
+                                return total;
+                        }
+                }
+                gtpDecodeBatch(pkts, n, &batch, anomalies);
+                for (c = 0; c < n; c++) {
+                        if (!handleEchoReply(&pkts[c], &batch, c, &t)) {
+                                t->stats.recvd++;
+                                targetInterim(t)->recvd++;
+                                t->lastRecvTime = pkts[c].time;
+                                (*replies)++;
+                        }
+                }
+                total += n;
+                reportAnomalies(0);
+                if (n < RECV_BATCH) {
+                        /* that was all of it */
+                        return total;
+                }
+        }
+}
+
+/**
+ * Handle everything on the socket error queue.
+ *
+ * return number of errors handled. If 'worst' is not NULL it's set to the
+ * highest value returned by handleRecvErr().
+ */
+static int
+drainRecvErr(int fd, int64_t lastPingTime, int *worst)
+{
+        int count = 0;
+        int e;
+
+        if (worst) {
+                *worst = 0;
+        }
+        while (0 < (e = handleRecvErr(fd, NULL, lastPingTime))) {
+                count++;
+                if (worst && e > *worst) {
+                        *worst = e;
+                }
+        }
+        return count;
+}
+
+/**
+ * Handle everything batchio has received.
+ *
+ * return number of replies. Errors are added to *recvErrors.
+ */
+static int
+reapBatchio(unsigned int *recvErrors)
+{
+        struct RecvPacket p;
+        struct GtpBatch batch;
+        struct Target *t;
+        int n = 0;
+
+        /* the packet's buffer is reused on the next call, so these are
+         * batches of one */
+        while (batchioNextPacket(&p)) {
+                if (p.err) {
+                        switch (p.err) {
+                        case ECONNREFUSED:
+                                connectionRefused++;
+                                break;
+                        case EHOSTUNREACH:
+                                break;
+                        default:
+                                fprintf(stderr, "%s: %s(%d, ...): %s\n",
+                                        argv0,
+                                        p.sendErr ? "send" : "recv",
+                                        p.fd, strerror(p.err));
+                        }
+                        *recvErrors += drainRecvErr(p.fd, 0, NULL);
+                        continue;
+                }
+                gtpDecodeBatch(&p, 1, &batch, anomalies);
+                if (!handleEchoReply(&p, &batch, 0, &t)) {
+                        t->stats.recvd++;
+                        targetInterim(t)->recvd++;
+                        t->lastRecvTime = p.time;
+                        n++;
+                }
+        }
+        reportAnomalies(0);
+        return n;
+}
+
 /**
  * FIXME: this function needs a cleanup, and probably some merging
  * with pingMainloop()
  */
 static int
-tracerouteMainloop(int fd)
+tracerouteMainloop(struct Target *t)
 {
+        int fd = t->fd;
         int ttl = 0;
         int ttlTry = 0;
-        double curPingTime;
-        double lastRecvTime = 0;
-        double lastPingTime = 0;
+        int64_t curPingTime;
+        int64_t lastRecvTime = 0;
+        int64_t lastPingTime = 0;
         int n;
         int endOfTraceroute = 0;
         int printStar = 0;
-        double timewait;
 
 	printf("GTPING traceroute to %s (%s) packet version %d.\n",
-	       options.target,
-	       options.targetip,
+	       t->target,
+	       t->targetip,
 	       (int)options.version);
 
+        if (eventLoopAdd(fd, 1)) {
+                return 1;
+        }
 
 	while (!sigintReceived) {
-		struct pollfd fds;
+		struct Event event;
 
-		fds.fd = fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
-                
                 /* time to send yet? */
-		curPingTime = clock_get_dbl();
+		curPingTime = clock_get_ns();
 		if ((lastRecvTime >= lastPingTime)
                     || (curPingTime > lastPingTime + options.interval)) {
                         if (printStar) {
@@ -1056,42 +1652,35 @@ tracerouteMainloop(int fd)
                                         strerror(errno));
                         }
 
-                        if (0 <= sendEcho(fd, curSeq++)) {
+                        if (0 <= sendEcho(t, t->curSeq++)) {
                                 lastPingTime = curPingTime;
                                 printStar = 1;
                         }
                 }
 
-                /* max waittime: until it's time to send the next one */
-		timewait = lastPingTime+options.interval - clock_get_dbl();
-		if (timewait < 0) {
-			timewait = 0;
-		}
-                timewait *= 0.5; /* leave room for overhead */
-
-		switch ((n = poll(&fds, 1, (int)(timewait * 1000)))) {
+                /* wake up when it's time to send the next one */
+		switch ((n = eventLoopWait(lastPingTime + options.interval,
+                                           &event, 1))) {
 		case 1: /* read ready */
-                        printStar = 0;
-			if (fds.revents & POLLERR) {
+			if (event.events & EVENT_ERROR) {
                                 int e;
-				e = handleRecvErr(fd, NULL, lastPingTime);
-                                if (e) {
-                                        lastRecvTime = clock_get_dbl();
+				if (drainRecvErr(fd, lastPingTime, &e)) {
+                                        printStar = 0;
+                                        lastRecvTime = clock_get_ns();
                                 }
                                 if (e > 1) {
                                         endOfTraceroute = 1;
                                 }
 			}
-			if (fds.revents & POLLIN) {
-				n = recvEchoReply(fd);
-                                endOfTraceroute = 1;
-                                if (!n) {
-                                        lastRecvTime = clock_get_dbl();
-                                } else if (n > 0) {
-                                        /* still ok, but no reply */
-                                        printStar = 1;
-                                } else {
-                                        return 1;
+			if (event.events & EVENT_READ) {
+                                int replies;
+                                if (recvEchoReplies(fd, &replies)) {
+                                        endOfTraceroute = 1;
+                                        /* read something, but no reply */
+                                        printStar = !replies;
+                                        if (replies) {
+                                                lastRecvTime = clock_get_ns();
+                                        }
                                 }
 			}
 			break;
@@ -1103,20 +1692,19 @@ tracerouteMainloop(int fd)
 			case EAGAIN:
 				break;
 			default:
-				fprintf(stderr, "%s: poll([%d], 1, %d): %s\n",
-					argv0,
-					fd,
-					(int)(timewait*1000),
-					strerror(errno));
+				fprintf(stderr, "%s: eventLoopWait(): %s\n",
+					argv0, strerror(errno));
 				exit(2);
 			}
 			break;
 		default: /* can't happen */
-			fprintf(stderr, "%s: poll() returned %d!\n", argv0, n);
+			fprintf(stderr, "%s: eventLoopWait() returned %d!\n",
+                                argv0, n);
 			exit(2);
 			break;
 		}
         }
+        reportAnomalies(1);
         return 0;
 }
 
@@ -1124,105 +1712,161 @@ tracerouteMainloop(int fd)
  * return value is sent directly to return value of main()
  */
 static int
-pingMainloop(int fd)
+pingMainloop(struct Target *t)
 {
-	unsigned sent = 0;
-	unsigned recvd = 0;
-	double lastpingTime = 0; /* last time we sent out a ping */
-	double curPingTime;   /* if we ping now, this is the timestamp of it */
-        double lastRecvTime = 0; /* last time we got a reply */
-        int recvErrors = 0;
+        int fd = t->fd;
+	int64_t lastpingTime = 0; /* last time we sent out a ping */
+	int64_t curPingTime;   /* if we ping now, this is the timestamp of it */
+        int64_t lastRecvTime = 0; /* last time we got a reply */
+        unsigned int recvErrors = 0;
 
 	if (options.verbose > 2) {
 		fprintf(stderr, "%s: mainloop(%d)\n", argv0, fd);
 	}
 
-	startTime = clock_get_dbl();
+	startTime = clock_get_ns();
 
 	printf("GTPING %s (%s) packet version %d\n",
-	       options.target,
-	       options.targetip,
+	       t->target,
+	       t->targetip,
 	       options.version);
 
+        /* flood sends a lot of packets, try to save some syscalls */
+        if (options.flood && !batchioInit()) {
+                useBatchio = 1;
+        }
+        if (useBatchio && !batchioAddSocket(fd)) {
+                if (eventLoopAdd(batchioFd(), 0)) {
+                        return 1;
+                }
+        } else if (eventLoopAdd(fd, 1)) {
+                return 1;
+        } else {
+                errInspectionTxTimestamps(fd);
+        }
+
         lastRecvTime = startTime;
+        t->nextPingTime = startTime;
+        interimStart = startTime;
+        nextReportTime = startTime + options.report;
 	while (!sigintReceived) {
-                /* max time to wait for replies before checking if it's time
+                /* when to stop waiting for replies and check if it's time
                  * to send another ping */
-		double timewait;
+		int64_t deadline;
+		int64_t reportDeadline;
 		int n;
-		struct pollfd fds;
+		struct Event event;
 
                 /* sent all we are going to send, and got all replies
                  * (either errors or good replies)
                  */
                 if (options.count
-                    && (sent == options.count)
-                    && (sent == (recvd + recvErrors))) {
+                    && (t->stats.sent == options.count)
+                    && (t->stats.sent == (t->stats.recvd + recvErrors))) {
                         break;
                 }
 
                 /* time to send yet? */
-		curPingTime = clock_get_dbl();
+		curPingTime = clock_get_ns();
+                reportDeadline = checkInterimReport(curPingTime);
 
                 /* if clock is not monotonic and time set backwards
                  * since last ping, start a new ping cycle */
                 if (curPingTime < lastpingTime) {
-                        lastpingTime = curPingTime - options.interval - 0.001;
+                        t->nextPingTime = curPingTime;
                 }
 
-		if (curPingTime > lastpingTime + options.interval) {
-			if (options.count && (curSeq == options.count)) {
-				if (lastRecvTime+options.wait < curPingTime) {
+		if (curPingTime >= t->nextPingTime) {
+			if (options.count && (t->curSeq == options.count)) {
+				if (lastRecvTime + t->wait < curPingTime) {
                                         break;
                                 }
-			} else if (0 <= sendEcho(fd, curSeq++)) {
-                                sent++;
-                                lastpingTime = curPingTime;
+			} else {
+                                /* if sends are batched anyway, flood sends
+                                 * more than one per loop */
+                                int burst = 1;
+                                if (useBatchio && !options.interval) {
+                                        burst = FLOOD_BURST;
+                                }
+                                for (; burst; burst--) {
+                                        if (options.count
+                                            && (t->curSeq == options.count)) {
+                                                break;
+                                        }
+                                        if (0 <= sendEcho(t, t->curSeq++)) {
+                                                if (options.interval) {
+                                                        noteSendLag(
+                                                            t,
+                                                            t->curSeq - 1,
+                                                            t->nextPingTime);
+                                                }
+                                                t->stats.sent++;
+                                                targetInterim(t)->sent++;
+                                                lastpingTime = curPingTime;
+                                                if (options.flood) {
+                                                        printf(".");
+                                                }
+                                        }
+                                }
                                 if (options.flood) {
-                                        printf(".");
                                         fflush(stdout);
                                 }
+                                countSendLag();
+
+                                /* next one is due an interval after this
+                                 * one was due, not after it was sent, so
+                                 * that delays don't add up. If we've
+                                 * fallen behind, don't try to catch up */
+                                t->nextPingTime += options.interval;
+                                if (t->nextPingTime < curPingTime) {
+                                        t->nextPingTime = curPingTime;
+                                }
 			}
 		}
-
-		fds.fd = fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
-		
-                /* max waittime: until it's time to send the next one */
-                timewait = lastpingTime+options.interval - clock_get_dbl();
-
-                /* never wait more than an interval. this can happen if
-                 * clock is not monotonic */
-                if (timewait > options.interval) {
-                        timewait = options.interval;
+                if (useBatchio) {
+                        batchioFlush();
+                        if (reapBatchio(&recvErrors)) {
+                                lastRecvTime = clock_get_ns();
+                        }
                 }
 
-                /* this should never happen, should have been taken care of
-                 * above. */
-		if (timewait < 0) {
-			timewait = 0;
-		}
+                if (options.count && (t->curSeq == options.count)) {
+                        /* all sent. Wake up when it's time to give up on
+                         * the rest */
+                        deadline = lastRecvTime + t->wait;
+                        if (deadline < lastpingTime + options.interval) {
+                                deadline = lastpingTime + options.interval;
+                        }
+                } else {
+                        /* until it's time to send the next one */
+                        deadline = t->nextPingTime;
 
-                /* leave room for overhead */
-                timewait *= 0.5;
+                        /* never wait more than an interval. this can happen
+                         * if clock is not monotonic */
+                        if (deadline > curPingTime + options.interval) {
+                                deadline = curPingTime + options.interval;
+                        }
+                }
+                if (reportDeadline >= 0 && reportDeadline < deadline) {
+                        deadline = reportDeadline;
+                }
 
-		switch ((n = poll(&fds, 1, (int)(timewait * 1000)))) {
+		switch ((n = eventLoopWait(deadline, &event, 1))) {
 		case 1: /* read ready */
-			if (fds.revents & POLLERR) {
-                                if (handleRecvErr(fd, NULL, 0)) {
-                                        recvErrors++;
+                        if (useBatchio && event.fd == batchioFd()) {
+                                if (reapBatchio(&recvErrors)) {
+                                        lastRecvTime = clock_get_ns();
                                 }
+                                break;
+                        }
+			if (event.events & EVENT_ERROR) {
+                                recvErrors += drainRecvErr(fd, 0, NULL);
 			}
-			if (fds.revents & POLLIN) {
-				n = recvEchoReply(fd);
-                                if (!n) {
-                                        recvd++;
-                                        lastRecvTime = clock_get_dbl();
-                                } else if (n > 0) {
-                                        /* still ok, but no reply */
-                                } else { /* n < 0 */
-                                        return 1;
+			if (event.events & EVENT_READ) {
+                                int replies;
+                                recvEchoReplies(fd, &replies);
+                                if (replies) {
+                                        lastRecvTime = clock_get_ns();
                                 }
 			}
 			break;
@@ -1234,46 +1878,791 @@ pingMainloop(int fd)
 			case EAGAIN:
 				break;
 			default:
-				fprintf(stderr, "%s: poll([%d], 1, %d): %s\n",
-					argv0,
-					fd,
-					(int)(timewait*1000),
-					strerror(errno));
+				fprintf(stderr, "%s: eventLoopWait(): %s\n",
+					argv0, strerror(errno));
 				exit(2);
 			}
 			break;
 		default: /* can't happen */
-			fprintf(stderr, "%s: poll() returned %d!\n", argv0, n);
+			fprintf(stderr, "%s: eventLoopWait() returned %d!\n",
+                                argv0, n);
 			exit(2);
 			break;
 		}
-			
 	}
+        targetLossFinish(t);
+        reportAnomalies(1);
 	printf("\n--- %s GTP ping statistics ---\n"
                "%u packets transmitted, %u received, "
                "%d%% packet loss, "
                "time %dms\n"
                "%u out of order, %u dups, "
                "%u connection refused",
-	       options.target,
-               sent, recvd,
-	       (int)((100.0*(sent-recvd))/sent),
-               (int)(1000*(clock_get_dbl()-startTime)),
-               reorder, dups,
+	       t->target,
+               t->stats.sent, t->stats.recvd,
+	       (int)((100.0*(t->stats.sent-t->stats.recvd))/t->stats.sent),
+               (int)NS2MS(clock_get_ns()-startTime),
+               t->stats.reorder, t->stats.dups,
                connectionRefused);
+        if (t->stats.restarts) {
+                printf(", %u restarts", t->stats.restarts);
+        }
+        if (t->stats.errorInds) {
+                printf(", %u error indications", t->stats.errorInds);
+        }
         errInspectionPrintSummary();
         printf("\n");
-	if (totalTimeCount) {
-		printf("rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f ms",
-		       1000*totalMin,
-		       1000*(totalTime / totalTimeCount),
-		       1000*totalMax,
-		       1000*sqrt((totalTimeSquared -
-				  (totalTime * totalTime)
-				  /totalTimeCount)/totalTimeCount));
+        statsPrintRtt(&t->stats);
+	printf("\n");
+        if (t->stats.totalTimeCount) {
+                statsPrintPercentiles("rtt", &t->stats);
+                printf("\n");
+                statsPrintDelayVar(&t->stats, targetJitter(t));
+                printf("\n");
+        }
+        if (statsPrintReorder(&t->stats)) {
+                printf("\n");
+        }
+        if (statsPrintLoss(&t->stats)) {
+                printf("\n");
+        }
+        printSendLag();
+	return t->stats.recvd == 0;
+}
+
+/**
+ * Pick a shared socket for a resolved target and add it to the target
+ * table. On failure the target is freed.
+ *
+ * return 0 on success, <0 if target was not added.
+ */
+static int
+addMultiTarget(struct Target *t)
+{
+        int err;
+
+        /* with -j the worker threads make their own sockets */
+        if (options.threads < 2
+            && 0 > (t->fd = getMultiSocket(t->addr.ss_family, t->tos))) {
+                err = t->fd;
+                goto errout;
+        }
+        if ((err = mkping(t))) {
+                fprintf(stderr, "%s: mkping(): %s\n", argv0, strerror(-err));
+                goto errout;
+        }
+        if ((err = targetTableAdd(&targets, t))) {
+                if (err == -EEXIST) {
+                        fprintf(stderr,
+                                "%s: duplicate target %s (%s), ignored\n",
+                                argv0, t->target, t->targetip);
+                } else {
+                        fprintf(stderr, "%s: adding target %s: %s\n",
+                                argv0, t->target, strerror(-err));
+                }
+                goto errout;
+        }
+        return 0;
+ errout:
+        targetFree(t);
+        return err;
+}
+
+/**
+ * Start adding a target. Numeric addresses are added right away. Names
+ * are handed to the resolver and added by collectResolved() when done, so
+ * that slow names don't hold up pinging the rest.
+ */
+static void
+submitMultiTarget(struct Target *t)
+{
+        switch (resolveTarget(t, 1)) {
+        case 0:
+                addMultiTarget(t);
+                break;
+        case 1:
+                resolverSubmit(t);
+                break;
+        default:
+                targetFree(t);
+        }
+}
+
+/**
+ * Schedule targets [first, targets.num) with their first pings spread out
+ * evenly over one interval from 'now'.
+ */
+static void
+scheduleNewTargets(size_t first, int64_t now)
+{
+        size_t c;
+        for (c = first; c < targets.num; c++) {
+                struct Target *t = targets.targets[c];
+                t->nextPingTime = now
+                        + (t->interval * (int64_t)(c - first))
+                        / (int64_t)(targets.num - first);
+                targetTableSchedule(&targets, t);
+        }
+}
+
+/**
+ * Add and schedule whatever complete lines can be read from the target
+ * list right now.
+ */
+static void
+loadTargetList(struct TargetList *tl, int64_t now)
+{
+        size_t first = targets.num;
+        char *line;
+
+        targetListFill(tl);
+        while ((line = targetListNextLine(tl))) {
+                struct Target *t;
+                if ((t = targetListParseLine(tl, line))) {
+                        submitMultiTarget(t);
+                }
+        }
+        scheduleNewTargets(first, now);
+}
+
+/**
+ * Add and schedule targets that the resolver is done with.
+ */
+static void
+collectResolved(int64_t now)
+{
+        size_t first = targets.num;
+        struct Target *t;
+
+        while ((t = resolverCollect())) {
+                if (t->resolveErr) {
+                        /* already reported */
+                        targetFree(t);
+                        continue;
+                }
+                addMultiTarget(t);
+        }
+        scheduleNewTargets(first, now);
+}
+
+/**
+ * return the longest wait time of this thread's targets.
+ */
+static int64_t
+targetsMaxWait()
+{
+        int64_t wait = 0;
+        size_t c;
+
+        for (c = 0; c < targets.num; c++) {
+                if (targets.targets[c]->wait > wait) {
+                        wait = targets.targets[c]->wait;
+                }
+        }
+        return wait;
+}
+
+/**
+ * Ping every target in the target table, from shared unconnected sockets,
+ * until done. Pings are sent in deadline order and replies are matched to
+ * targets by source address. If 'tl' is not NULL more targets are read
+ * from it while pinging.
+ *
+ * return 0 when done, 1 on fatal error.
+ */
+static int
+multiPingLoop(struct TargetList *tl)
+{
+        int64_t lastpingTime = 0; /* last time we sent out any ping */
+        int64_t lastRecvTime;     /* last time we got any reply */
+        unsigned int recvErrors = 0;
+        struct Stats total;
+
+        scheduleNewTargets(0, startTime);
+
+        if (tl && eventLoopAdd(tl->fd, 0)) {
+                return 1;
+        }
+        if (useBatchio && 0 <= batchioFd()
+            && eventLoopAdd(batchioFd(), 0)) {
+                return 1;
+        }
+        if (wakeFd >= 0 && eventLoopAdd(wakeFd, 0)) {
+                return 1;
+        }
+
+        statsInit(&total);
+        lastRecvTime = startTime;
+        interimStart = startTime;
+        nextReportTime = startTime + options.report;
+	while (!sigintReceived) {
+                struct Target *t;
+                struct Event events[64];
+		int64_t curPingTime;
+		int64_t deadline;
+		int64_t reportDeadline;
+                int64_t wait;
+                size_t budget;
+		int n;
+                int i;
+
+		curPingTime = clock_get_ns();
+                reportDeadline = checkInterimReport(curPingTime);
+
+                if (resolverPending()) {
+                        int fd = resolverFd();
+                        if (fd < 0) {
+                                /* resolver has no fd to wait for */
+                                collectResolved(curPingTime);
+                        } else if (!resolverFdAdded) {
+                                eventLoopAdd(fd, 0);
+                                resolverFdAdded = 1;
+                        }
+                }
+
+                /* send all pings that are due. Each target at most once per
+                 * loop so that -f without -i doesn't starve the receiver */
+                for (budget = targets.heapLen;
+                     budget
+                             && (t = targetTableNext(&targets))
+                             && (t->nextPingTime <= curPingTime);
+                     budget--) {
+                        if (0 <= sendEcho(t, t->curSeq++)) {
+                                if (t->interval) {
+                                        noteSendLag(t, t->curSeq - 1,
+                                                    t->nextPingTime);
+                                }
+                                t->stats.sent++;
+                                targetInterim(t)->sent++;
+                                total.sent++;
+                                t->lastPingTime = curPingTime;
+                                lastpingTime = curPingTime;
+                                if (options.flood) {
+                                        printf(".");
+                                }
+                        }
+                        if (options.count && (t->curSeq == options.count)) {
+                                targetTableUnschedule(&targets, t);
+                                continue;
+                        }
+                        t->nextPingTime += t->interval;
+                        /* if we've fallen behind, don't try to catch up */
+                        if (t->nextPingTime < curPingTime) {
+                                t->nextPingTime = curPingTime;
+                        }
+                        targetTableReschedule(&targets, t);
+                }
+                if (options.flood) {
+                        fflush(stdout);
+                }
+                countSendLag();
+                if (useBatchio) {
+                        batchioFlush();
+                        if ((n = reapBatchio(&recvErrors))) {
+                                total.recvd += n;
+                                lastRecvTime = clock_get_ns();
+                        }
+                }
+
+                if (tl && tl->eof) {
+                        eventLoopDel(tl->fd);
+                        targetListClose(tl);
+                        tl = NULL;
+                }
+                if (!tl && !resolverPending() && !targets.num) {
+                        fprintf(stderr, "%s: no usable targets\n", argv0);
+                        return 1;
+                }
+
+                if (options.count && !targets.heapLen && !tl
+                    && !resolverPending()) {
+                        /* sent all we are going to send, and got all
+                         * replies (either errors or good replies) */
+                        if (total.sent == total.recvd + recvErrors) {
+                                break;
+                        }
+                        wait = targetsMaxWait();
+                        if ((lastRecvTime + wait < curPingTime)
+                            && (lastpingTime + wait < curPingTime)) {
+                                break;
+                        }
+                }
+
+                if ((t = targetTableNext(&targets))) {
+                        /* until it's time to send the next one */
+                        deadline = t->nextPingTime;
+
+                        /* never wait more than an interval. this can happen
+                         * if clock is not monotonic */
+                        if (deadline > curPingTime + options.interval) {
+                                deadline = curPingTime + options.interval;
+                        }
+                } else if (options.count && !tl && !resolverPending()) {
+                        /* all sent. Wake up when it's time to give up on
+                         * the rest */
+                        deadline = lastRecvTime;
+                        if (deadline < lastpingTime) {
+                                deadline = lastpingTime;
+                        }
+                        deadline += targetsMaxWait();
+                } else {
+                        /* nothing to do until targets show up */
+                        deadline = -1;
+                }
+                if (reportDeadline >= 0
+                    && (deadline < 0 || reportDeadline < deadline)) {
+                        deadline = reportDeadline;
+                }
+
+		switch ((n = eventLoopWait(deadline, events,
+                                           sizeof(events)/sizeof(events[0])))) {
+		case 0: /* timeout */
+			break;
+		case -1: /* error */
+			switch (errno) {
+			case EINTR:
+			case EAGAIN:
+				break;
+			default:
+				fprintf(stderr, "%s: eventLoopWait(): %s\n",
+					argv0, strerror(errno));
+				exit(2);
+			}
+			break;
+		default: /* read ready */
+                        for (i = 0; i < n; i++) {
+                                int fd = events[i].fd;
+                                int r;
+
+                                if (fd == wakeFd) {
+                                        /* signal, checked at the top */
+                                        char buf[64];
+                                        while (0 < read(wakeFd, buf,
+                                                        sizeof(buf))) {
+                                        }
+                                        continue;
+                                }
+                                if (tl && fd == tl->fd) {
+                                        loadTargetList(tl, clock_get_ns());
+                                        continue;
+                                }
+                                if (resolverFdAdded && fd == resolverFd()) {
+                                        collectResolved(clock_get_ns());
+                                        continue;
+                                }
+                                if (useBatchio && fd == batchioFd()) {
+                                        if ((r = reapBatchio(&recvErrors))) {
+                                                total.recvd += r;
+                                                lastRecvTime = clock_get_ns();
+                                        }
+                                        continue;
+                                }
+                                if (events[i].events & EVENT_ERROR) {
+                                        recvErrors += drainRecvErr(fd, 0, NULL);
+                                }
+                                if (!(events[i].events & EVENT_READ)) {
+                                        continue;
+                                }
+                                recvEchoReplies(fd, &r);
+                                if (r) {
+                                        total.recvd += r;
+                                        lastRecvTime = clock_get_ns();
+                                }
+                        }
+			break;
+		}
 	}
+        reportAnomalies(1);
+        return 0;
+}
+
+/**
+ * Print per-target and total statistics for 'num' targets in 'list'.
+ *
+ * return value is sent directly to return value of main()
+ */
+static int
+multiPingReport(struct Target **list, size_t num)
+{
+        unsigned int noReply = 0;
+        struct Stats total;
+        int64_t jitterSum = 0;
+        unsigned int jitterCount = 0;
+        size_t c;
+
+	printf("\n--- GTP ping statistics ---\n");
+        statsInit(&total);
+        for (c = 0; c < num; c++) {
+                struct Target *t = list[c];
+                targetLossFinish(t);
+                printf("%s (%s): "
+                       "%u transmitted, %u received, %d%% packet loss, "
+                       "%u out of order, %u dups",
+                       t->target,
+                       t->targetip,
+                       t->stats.sent, t->stats.recvd,
+                       t->stats.sent
+                       ? (int)((100.0*(t->stats.sent-t->stats.recvd))
+                               /t->stats.sent)
+                       : 0,
+                       t->stats.reorder, t->stats.dups);
+                if (t->stats.restarts) {
+                        printf(", %u restarts", t->stats.restarts);
+                }
+                if (t->stats.errorInds) {
+                        printf(", %u error indications",
+                               t->stats.errorInds);
+                }
+                if (t->stats.totalTimeCount) {
+                        int64_t jitter = targetJitter(t);
+                        printf(", ");
+                        statsPrintRtt(&t->stats);
+                        printf(", ");
+                        statsPrintDelayVar(&t->stats, jitter);
+                        if (jitter >= 0) {
+                                jitterSum += jitter;
+                                jitterCount++;
+                        }
+                }
+                if (t->stats.reorder || t->stats.gaps) {
+                        printf(", ");
+                        statsPrintReorder(&t->stats);
+                }
+                if (t->stats.loss.classifiedLost) {
+                        printf(", ");
+                        statsPrintLoss(&t->stats);
+                }
+                printf("\n");
+                if (!t->stats.recvd) {
+                        noReply++;
+                }
+                statsMerge(&total, &t->stats);
+        }
+
+	printf("\n--- total for %u targets ---\n"
+               "%u packets transmitted, %u received, "
+               "%d%% packet loss, "
+               "time %dms\n"
+               "%u out of order, %u dups, "
+               "%u connection refused",
+               (unsigned)num,
+               total.sent, total.recvd,
+               total.sent
+               ? (int)((100.0*(total.sent-total.recvd))/total.sent)
+               : 0,
+               (int)NS2MS(clock_get_ns()-startTime),
+               total.reorder, total.dups,
+               connectionRefused);
+        if (total.restarts) {
+                printf(", %u restarts", total.restarts);
+        }
+        if (total.errorInds) {
+                printf(", %u error indications", total.errorInds);
+        }
+        errInspectionPrintSummary();
+        printf("\n");
+        statsPrintRtt(&total);
 	printf("\n");
-	return recvd == 0;
+        if (total.totalTimeCount) {
+                statsPrintPercentiles("rtt", &total);
+                printf("\n");
+                /* jitter of the total is the average of the targets' */
+                statsPrintDelayVar(&total,
+                                   jitterCount
+                                   ? jitterSum / jitterCount : -1);
+                printf("\n");
+        }
+        if (statsPrintReorder(&total)) {
+                printf("\n");
+        }
+        if (statsPrintLoss(&total)) {
+                printf("\n");
+        }
+        statsFree(&total);
+        printSendLag();
+	return noReply != 0;
+}
+
+/**
+ * Ping every target in the target table, and from 'tl' if not NULL.
+ *
+ * return value is sent directly to return value of main()
+ */
+static int
+multiPingMainloop(struct TargetList *tl)
+{
+	if (options.verbose > 2) {
+		fprintf(stderr, "%s: multiPingMainloop(%u)\n",
+                        argv0, (unsigned)targets.num);
+	}
+
+	startTime = clock_get_ns();
+
+        if (tl && !targets.num && !resolverPending()) {
+                printf("GTPING targets from %s, packet version %d\n",
+                       tl->filename,
+                       options.version);
+        } else if (tl) {
+                printf("GTPING %u targets and targets from %s, "
+                       "packet version %d\n",
+                       (unsigned)(targets.num + resolverPending()),
+                       tl->filename,
+                       options.version);
+        } else {
+                printf("GTPING %u targets packet version %d\n",
+                       (unsigned)(targets.num + resolverPending()),
+                       options.version);
+        }
+
+        if (multiPingLoop(tl)) {
+                return 1;
+        }
+        return multiPingReport(targets.targets, targets.num);
+}
+
+/**
+ * Read all of 'tl' and wait for the resolver to finish with every name.
+ * Used with -j, where targets are split between threads up front.
+ *
+ * return 0 on success, 1 on error or SIGINT.
+ */
+static int
+loadAllTargets(struct TargetList *tl)
+{
+        if (tl && eventLoopAdd(tl->fd, 0)) {
+                return 1;
+        }
+        while (!sigintReceived) {
+                struct Event events[4];
+                int n;
+                int i;
+
+                if (resolverPending()) {
+                        int fd = resolverFd();
+                        if (fd < 0) {
+                                collectResolved(clock_get_ns());
+                        } else if (!resolverFdAdded) {
+                                eventLoopAdd(fd, 0);
+                                resolverFdAdded = 1;
+                        }
+                }
+                if (tl && tl->eof) {
+                        eventLoopDel(tl->fd);
+                        targetListClose(tl);
+                        tl = NULL;
+                }
+                if (!tl && !resolverPending()) {
+                        return 0;
+                }
+                n = eventLoopWait(-1, events,
+                                  sizeof(events)/sizeof(events[0]));
+                for (i = 0; i < n; i++) {
+                        if (tl && events[i].fd == tl->fd) {
+                                loadTargetList(tl, clock_get_ns());
+                        } else if (resolverFdAdded
+                                   && events[i].fd == resolverFd()) {
+                                collectResolved(clock_get_ns());
+                        }
+                }
+        }
+        return 1;
+}
+
+/**
+ * One -j worker's share of the targets, and what it saw.
+ */
+struct Shard {
+        struct Target **targets;
+        size_t num;
+        unsigned int connectionRefused;
+        unsigned int icmpErrors;
+        struct Stats sendLag;
+        int wakeFd;                  /* read end of its wakePipes[] */
+        int ret;
+};
+
+/**
+ * -j worker thread. Makes its own sockets, event loop and batched I/O for
+ * its targets and pings them. Everything it touches is either thread-local
+ * or owned by its targets, so no locking is needed.
+ */
+static void*
+shardMain(void *arg)
+{
+        struct Shard *shard = arg;
+        size_t c;
+
+        targetTableInit(&targets);
+        statsInit(&sendLag);
+        wakeFd = shard->wakeFd;
+        useBatchio = !batchioInit();
+        for (c = 0; c < shard->num; c++) {
+                struct Target *t = shard->targets[c];
+                int err;
+
+                if (0 > (t->fd = getMultiSocket(t->addr.ss_family, t->tos))) {
+                        continue;
+                }
+                if ((err = targetTableAdd(&targets, t))) {
+                        fprintf(stderr, "%s: adding target %s: %s\n",
+                                argv0, t->target, strerror(-err));
+                }
+        }
+        shard->ret = multiPingLoop(NULL);
+        shard->connectionRefused = connectionRefused;
+        shard->icmpErrors = errInspectionCount();
+        shard->sendLag = sendLag;
+
+        /* targets are owned by shardedMainloop() */
+        targetTableClear(&targets);
+        return NULL;
+}
+
+/**
+ * Make a non-blocking wake up pipe for each of 'num' workers. The signal
+ * handlers write to all of them once the last one is made.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+static int
+openWakePipes(size_t num)
+{
+        size_t c;
+        int i;
+
+        if (!(wakePipes = calloc(num, sizeof(*wakePipes)))) {
+                int err = errno;
+                fprintf(stderr, "%s: malloc(): %s\n", argv0, strerror(err));
+                return -err;
+        }
+        for (c = 0; c < num; c++) {
+                if (pipe(wakePipes[c])) {
+                        int err = errno;
+                        fprintf(stderr, "%s: pipe(): %s\n",
+                                argv0, strerror(err));
+                        while (c--) {
+                                close(wakePipes[c][0]);
+                                close(wakePipes[c][1]);
+                        }
+                        free(wakePipes);
+                        wakePipes = NULL;
+                        return -err;
+                }
+                for (i = 0; i < 2; i++) {
+                        fcntl(wakePipes[c][i], F_SETFL,
+                              fcntl(wakePipes[c][i], F_GETFL) | O_NONBLOCK);
+                }
+        }
+        numWakePipes = num;
+        return 0;
+}
+
+/**
+ * Close the pipes from openWakePipes(), if any.
+ */
+static void
+closeWakePipes()
+{
+        size_t num = numWakePipes;
+        size_t c;
+
+        numWakePipes = 0;
+        for (c = 0; c < num; c++) {
+                close(wakePipes[c][0]);
+                close(wakePipes[c][1]);
+        }
+        free(wakePipes);
+        wakePipes = NULL;
+}
+
+/**
+ * -j: split the targets between worker threads, round-robin, and report on
+ * all of them in the original order once the workers are done.
+ *
+ * return value is sent directly to return value of main()
+ */
+static int
+shardedMainloop(struct TargetList *tl)
+{
+        struct Shard *shards = NULL;
+        struct Target **all = NULL;
+        void **args = NULL;
+        size_t num;
+        size_t numShards;
+        size_t c;
+        int ret = 1;
+
+        if (loadAllTargets(tl)) {
+                return 1;
+        }
+        if (!(num = targets.num)) {
+                fprintf(stderr, "%s: no usable targets\n", argv0);
+                return 1;
+        }
+        numShards = options.threads;
+        if (numShards > num) {
+                numShards = num;
+        }
+
+        if (!(all = malloc(num * sizeof(struct Target*)))
+            || !(shards = calloc(numShards, sizeof(struct Shard)))
+            || !(args = malloc(numShards * sizeof(void*)))) {
+                fprintf(stderr, "%s: malloc(): %s\n", argv0, strerror(errno));
+                goto out;
+        }
+        memcpy(all, targets.targets, num * sizeof(struct Target*));
+        for (c = 0; c < numShards; c++) {
+                if (!(shards[c].targets = malloc(((num + numShards - 1)
+                                                  / numShards)
+                                                 * sizeof(struct Target*)))) {
+                        fprintf(stderr, "%s: malloc(): %s\n",
+                                argv0, strerror(errno));
+                        goto out;
+                }
+                args[c] = &shards[c];
+        }
+        for (c = 0; c < num; c++) {
+                struct Shard *shard = &shards[c % numShards];
+                shard->targets[shard->num++] = all[c];
+        }
+
+        /* the workers have their own tables from here on */
+        targetTableClear(&targets);
+
+        if (openWakePipes(numShards)) {
+                goto out;
+        }
+        for (c = 0; c < numShards; c++) {
+                shards[c].wakeFd = wakePipes[c][0];
+        }
+
+        printf("GTPING %u targets packet version %d, %u threads\n",
+               (unsigned)num, options.version, (unsigned)numShards);
+        startTime = clock_get_ns();
+        workersRun(numShards, shardMain, args);
+
+        ret = 0;
+        for (c = 0; c < numShards; c++) {
+                connectionRefused += shards[c].connectionRefused;
+                errInspectionMerge(shards[c].icmpErrors);
+                statsMerge(&sendLag, &shards[c].sendLag);
+                statsFree(&shards[c].sendLag);
+                ret |= shards[c].ret;
+        }
+        if (!ret) {
+                ret = multiPingReport(all, num);
+        }
+ out:
+        closeWakePipes();
+        if (shards) {
+                for (c = 0; c < numShards; c++) {
+                        free(shards[c].targets);
+                }
+        }
+        free(shards);
+        free(args);
+        free(all);
+        return ret;
 }
 
 /**
@@ -1307,30 +2696,53 @@ static void
 usage(int err)
 {
         printf("Usage: %s "
-               "[ -46hfvV ] "
+               "[ -46hfuvV ] "
+               "[ -A <accuracy> ] "
                "[ -c <count> ] "
-               "[ -i <time> ] "
+               "[ -e <type>[:<hex>] ] "
                "\n       %s "
+               "[ -i <time> ] "
+               "[ -j <threads> ] "
+               "[ -L <file> ] "
                "[ -p <port> ] "
                "[ -P <port> ] "
+               "\n       %s "
                "[ -Q <dscp> ] "
                "[ -r[<perhop>] ] "
-               "\n       %s "
+               "[ -R <time> ] "
                "[ -s <source> ] "
                "[ -t <teid> ] "
-               "[ -T <ttl> ] "
                "\n       %s "
+               "[ -T <ttl> ] "
                "[ -w <time> ] "
-               "<target>\n"
+               "[ -z <size> ] "
+               "<target> [ <target> ... ]\n"
                "\t-4               Force IPv4 (default: auto-detect)\n"
                "\t-6               Force IPv6 (default: auto-detect)\n"
+               "\t-A, --sketch <accuracy>\n"
+               "\t                 Percentiles from a small sketch with "
+               "this relative\n"
+               "\t                 accuracy (e.g. 0.01), for many targets "
+               "(default: off)\n"
                "\t-c <count>       Stop after sending count pings "
                "(default: 0=Infinite)\n"
+               "\t-e <type>[:<hex>]\n"
+               "\t                 Add GTPv1 extension header with this "
+               "content. Can be\n"
+               "\t                 repeated. Example: PDU Session "
+               "Container 0x85:1009\n"
                "\t-f               Flood ping mode (limit with -i)\n"
                "\t-h, --help       Show this help text\n"
                "\t-g <version>     Set GTP version (default: %u)\n"
                "\t-i <time>        Time between pings in seconds "
                "(default: %.1f)\n"
+               "\t-j, --threads <threads>\n"
+               "\t                 Split multiple targets between threads "
+               "(default: 1)\n"
+               "\t-L <file>        Read more targets from file, one per line "
+               "(- for stdin)\n"
+               "\t                 Per-line settings: port= version= "
+               "teid= dscp= interval=\n"
                "\t-p <port>        GTP-C UDP port to ping (default: %s)\n"
                "\t                 GTP-C is 2123, GTP-U is port 2152, "
                "GTP' is port 3386.\n"
@@ -1342,15 +2754,23 @@ usage(int err)
                "(default: %d)\n"
                "\t                 Traceroute will only work correctly "
                "on Linux.\n"
+               "\t-R <time>        Print statistics for the last <time> "
+               "seconds every <time>\n"
+               "\t                 seconds. SIGQUIT and SIGUSR1 print "
+               "them any time.\n"
                "\t-s <source>      Use this source address or interface\n"
                "\t                 Interface name will not work on all OSs\n"
                "\t-t <teid>        Transaction ID "
                "(default: not present or 0)\n"
                "\t-T <ttl>         IP TTL (default: system default)\n"
+               "\t-u               GTP-U echo: port %s, restart counters "
+               "ignored\n"
                "\t-v               Increase verbosity level (default: %d)\n"
                "\t-V, --version    Show version info and exit\n"
                "\t-w <time>        Time to wait for a response "
                "(default: 2*RTT or %.2fs)\n"
+               "\t-z <size>        Pad GTPv1 echo requests to this many "
+               "bytes\n"
                "\n"
                "Report bugs to: thomas@habets.pp.se\n"
                "gtping home page: "
@@ -1363,6 +2783,7 @@ usage(int err)
                DEFAULT_INTERVAL,
                DEFAULT_PORT,
                DEFAULT_TRACEROUTEHOPS,
+               DEFAULT_PORT_GTPU,
                DEFAULT_VERBOSE,
                DEFAULT_WAIT);
         exit(err);
@@ -1387,7 +2808,7 @@ printVersion()
 /**
  * return -1 on error, or 8bit number to put in IP ToS-field.
  */
-static int
+int
 string2Tos(const char *instr)
 {
         const char *rets = NULL;
@@ -1443,13 +2864,60 @@ string2Tos(const char *instr)
         return ret;
 }
 
+/**
+ * Add extension header "<type>[:<hex content>]" to the end of the -e
+ * chain.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+static int
+addExtHeader(const char *arg)
+{
+        unsigned char content[255 * 4 - 2];
+        unsigned char *p;
+        unsigned long type;
+        size_t len = 0;
+        size_t n;
+        char *end;
+
+        type = strtoul(arg, &end, 0);
+        if (end == arg || !type || type > 255) {
+                return -EINVAL;
+        }
+        if (*end == ':') {
+                for (end++; isxdigit(end[0]) && isxdigit(end[1]); end += 2) {
+                        unsigned int byte;
+                        if (len == sizeof(content)
+                            || 1 != sscanf(end, "%2x", &byte)) {
+                                return -EINVAL;
+                        }
+                        content[len++] = byte;
+                }
+        }
+        if (*end) {
+                return -EINVAL;
+        }
+        if (!(p = realloc(options.ext, options.extLen + sizeof(content) + 2))) {
+                return -errno;
+        }
+        options.ext = p;
+        n = gtpPutExt(p + options.extLen, content, len);
+        if (options.extLen) {
+                /* next-type of the one before */
+                p[options.extLen - 1] = type;
+        } else {
+                options.firstExt = type;
+        }
+        options.extLen += n;
+        return 0;
+}
+
 /**
  *
  */
 int
 main(int argc, char **argv)
 {
-	int fd;
         int port_set = 0;
 
 	printf("GTPing %s\n", version);
@@ -1465,6 +2933,10 @@ main(int argc, char **argv)
                                 usage(0);
                         } else if (!strcmp(argv[c], "--version")) {
                                 printVersion();
+                        } else if (!strcmp(argv[c], "--threads")) {
+                                argv[c] = "-j";
+                        } else if (!strcmp(argv[c], "--sketch")) {
+                                argv[c] = "-A";
                         }
                 }
         }
@@ -1475,7 +2947,7 @@ main(int argc, char **argv)
                 unsigned int tmpu;
 		while (-1 != (c=getopt(argc,
                                        argv,
-                                       "46c:fhi:g:p:P:Q:r::s:t:T:vVw:"))) {
+                                       "46A:c:e:fhi:g:j:L:p:P:Q:r::R:s:t:T:uvVw:z:"))) {
 			switch(c) {
                         case '4':
                                 options.af = AF_INET;
@@ -1483,9 +2955,29 @@ main(int argc, char **argv)
                         case '6':
                                 options.af = AF_INET6;
                                 break;
+                        case 'A':
+                                options.sketch = atof(optarg);
+                                if (options.sketch <= 0
+                                    || options.sketch >= 1) {
+                                        fprintf(stderr,
+                                                "%s: invalid accuracy "
+                                                "\"%s\"\n",
+                                                argv0, optarg);
+                                        usage(2);
+                                }
+                                break;
 			case 'c':
 				options.count = strtoul(optarg, 0, 0);
 				break;
+                        case 'e':
+                                if (addExtHeader(optarg)) {
+                                        fprintf(stderr,
+                                                "%s: invalid extension "
+                                                "header \"%s\"\n",
+                                                argv0, optarg);
+                                        usage(2);
+                                }
+                                break;
                         case 'f':
                                 options.flood = 1;
                                 /* if interval not alread set, set it to 0 */
@@ -1510,6 +3002,12 @@ main(int argc, char **argv)
 			case 'h':
 				usage(0);
 				break;
+                        case 'j':
+                                options.threads = strtoul(optarg, 0, 0);
+                                break;
+                        case 'L':
+                                options.targetlist = optarg;
+                                break;
 			case 'p':
 				options.port = optarg;
                                 port_set = 1;
@@ -1530,16 +3028,19 @@ main(int argc, char **argv)
                                         options.ttl = 255;
                                 }
 				break;
+                        case 'u':
+                                options.gtpu = 1;
+                                break;
 			case 'v':
 				options.verbose++;
 				break;
                         case 'V':
                                 printVersion();
 			case 'i':
-				options.interval = atof(optarg);
+				options.interval = SEC2NS(atof(optarg));
 				break;
 			case 'w':
-				options.wait = atof(optarg);
+				options.wait = SEC2NS(atof(optarg));
 				break;
                         case 'Q':
                                 if (-1 == (options.tos = string2Tos(optarg))) {
@@ -1553,12 +3054,28 @@ main(int argc, char **argv)
                                                 argv0);
                                 }
                                 break;
+                        case 'R':
+                                options.report = SEC2NS(atof(optarg));
+                                if (options.report < 0) {
+                                        options.report = 0;
+                                }
+                                break;
                         case 'r':
                                 options.traceroute = 1;
                                 if (optarg) {
                                         options.traceroutehops = atoi(optarg);
                                 }
                                 break;
+                        case 'z':
+                                options.padTo = strtoul(optarg, 0, 0);
+                                if (options.padTo > MAX_PADTO) {
+                                        fprintf(stderr,
+                                                "%s: can't pad to more than "
+                                                "%d bytes\n",
+                                                argv0, MAX_PADTO);
+                                        usage(2);
+                                }
+                                break;
 			case '?':
 			default:
 				usage(2);
@@ -1566,38 +3083,122 @@ main(int argc, char **argv)
 		}
 	}
         if (0 > options.interval) {
-                options.interval = DEFAULT_INTERVAL;
+                options.interval = SEC2NS(DEFAULT_INTERVAL);
         }
         if (0 > options.wait) {
-                options.wait = DEFAULT_WAIT;
+                options.wait = SEC2NS(DEFAULT_WAIT);
                 options.autowait = 1;
                 if (options.verbose > 1) {
                         fprintf(stderr, "%s: autowait is ON. "
                                 "Initial wait: %6.3f seconds\n",
-                                argv0, options.wait);
+                                argv0, (double)options.wait / NS_PER_SEC);
                 }
         }
 
-	if (optind + 1 != argc) {
+	if (optind >= argc && !options.targetlist) {
 		usage(2);
 	}
-
-	options.target = argv[optind];
+        if (options.traceroute
+            && (optind + 1 != argc || options.targetlist)) {
+                fprintf(stderr, "%s: traceroute only takes one target\n",
+                        argv0);
+                usage(2);
+        }
+        if (options.gtpu) {
+                if (!port_set) {
+                        options.port = DEFAULT_PORT_GTPU;
+                }
+                if (options.version != 1) {
+                        fprintf(stderr, "%s: GTP-U is GTPv1 only\n", argv0);
+                        usage(2);
+                }
+        }
+        if ((options.extLen || options.padTo) && options.version != 1) {
+                fprintf(stderr, "%s: -e and -z are for GTPv1 only\n",
+                        argv0);
+                usage(2);
+        }
+        if (options.sketch) {
+                sketchSetAccuracy(options.sketch);
+        }
+        if (options.threads < 1) {
+                options.threads = 1;
+        }
+        if (options.threads > (unsigned)workersMax()) {
+                fprintf(stderr, "%s: can't use %u threads, using %d\n",
+                        argv0, options.threads, workersMax());
+                options.threads = workersMax();
+        }
+        if (options.threads > 1 && strcmp(options.source_port, "0")) {
+                /* replies are matched to the socket they were sent from,
+                 * so each thread needs a source port of its own */
+                fprintf(stderr, "%s: -j and -P can't be used together\n",
+                        argv0);
+                usage(2);
+        }
 
 	if (SIG_ERR == signal(SIGINT, sigint)) {
 		fprintf(stderr, "%s: signal(SIGINT, ...): %s\n",
 			argv0, strerror(errno));
 		return 1;
 	}
-
-	if (0 > (fd = setupSocket())) {
+	if (SIG_ERR == signal(SIGQUIT, sigreport)
+            || SIG_ERR == signal(SIGUSR1, sigreport)) {
+		fprintf(stderr, "%s: signal(SIGQUIT/SIGUSR1, ...): %s\n",
+			argv0, strerror(errno));
 		return 1;
 	}
-        if (options.traceroute) {
-                return tracerouteMainloop(fd);
-        } else {
-                return pingMainloop(fd);
+
+        targetTableInit(&targets);
+        statsInit(&sendLag);
+
+        /* one target: use a connected socket */
+        if (optind + 1 == argc && !options.targetlist) {
+                struct Target *t;
+                if (!(t = targetNew(argv[optind]))) {
+                        fprintf(stderr, "%s: malloc(): %s\n",
+                                argv0, strerror(errno));
+                        return 1;
+                }
+                if (0 > setupSocket(t)
+                    || targetTableAdd(&targets, t)) {
+                        return 1;
+                }
+                if (options.traceroute) {
+                        return tracerouteMainloop(t);
+                } else {
+                        return pingMainloop(t);
+                }
+        }
+
+        /* many targets: share unconnected sockets, and send and receive
+         * in batches if possible. With -j each thread does its own. */
+        if (options.threads < 2) {
+                useBatchio = !batchioInit();
+        }
+        for (; optind < argc; optind++) {
+                struct Target *t;
+                if (!(t = targetNew(argv[optind]))) {
+                        fprintf(stderr, "%s: malloc(): %s\n",
+                                argv0, strerror(errno));
+                        return 1;
+                }
+                submitMultiTarget(t);
+        }
+        if (options.targetlist) {
+                static struct TargetList tl;
+                if (targetListOpen(&tl, options.targetlist)) {
+                        return 1;
+                }
+                if (options.threads > 1) {
+                        return shardedMainloop(&tl);
+                }
+                return multiPingMainloop(&tl);
+        }
+        if (options.threads > 1) {
+                return shardedMainloop(NULL);
         }
+        return multiPingMainloop(NULL);
 }
 
 /* ---- Emacs Variables ----
@@ -14,48 +14,53 @@
 
 #include "getaddrinfo.h"
 
-/* GTP packet as used with GTP Echo */
-#pragma pack(1)
-struct GtpEchoV1 {
-        int has_npdu:1;
-        int has_seq:1;
-        int has_ext_head:1;
-        int res1:1;
-        int proto_type:1;
-        int version:3;
-
-        uint8_t msg;
-        uint16_t len;
-        uint32_t teid;
-        uint16_t seq;
-        uint8_t npdu;
-        uint8_t next;
+/* Module state that each -j worker thread has its own copy of. See
+ * workers_pthread.c */
+#ifdef HAVE_TLS
+#define THREADLOCAL __thread
+#else
+#define THREADLOCAL
+#endif
+
+/* Times are int64_t nanoseconds on the clock_get_ns() clock. Seconds as
+ * double are only for the command line and for display. */
+#define NS_PER_SEC 1000000000LL
+#define SEC2NS(s) ((int64_t)((s) * NS_PER_SEC))
+#define NS2MS(ns) ((ns) / 1000000.0)
+
+/* GTP header, see gtpheader.c */
+#define GTPV1_FLAG_PT 0x10           /* GTP, as opposed to GTP' */
+#define GTPV1_FLAG_E  0x04           /* extension header */
+#define GTPV1_FLAG_S  0x02           /* sequence number */
+#define GTPV1_FLAG_PN 0x01           /* N-PDU number */
+#define GTPV2_FLAG_P  0x10           /* piggybacked message */
+#define GTPV2_FLAG_T  0x08           /* TEID */
+#define GTP_HDRLEN_V1      12        /* with the optional fields */
+#define GTP_HDRLEN_V2      8
+#define GTP_HDRLEN_V2_TEID 12
+#define GTP_HDRLEN_MAX     12
+#define GTPV1_IE_RECOVERY  14        /* TV, restart counter */
+#define GTPV1_IE_TEID_DATA 16        /* TV */
+#define GTPV1_IE_PEERADDR  133       /* GTP-U peer address */
+#define GTPV1_IE_EXTHDRLIST 141      /* extension header type list */
+#define GTPV1_IE_PRIVATE   255       /* TLV, min 2 bytes of value */
+#define GTPV1_IELEN_PRIVATE_MIN 5
+#define GTPV2_IE_RECOVERY  3
+#define GTPV2_IELEN_RECOVERY 5       /* with IE header */
+struct GtpLayout {
+        unsigned char len;
+        unsigned char lenBase;       /* octets not in length field */
+        unsigned char teidOff;
+        unsigned char seqOff;
+        unsigned char npduOff;
+        unsigned char nextOff;
+        unsigned char oddFlags;      /* flags we don't expect in replies */
 };
-#pragma pack()
-#pragma pack(1)
-#define GTPECHOv2_LEN_WITHOUT_TEID 8
-struct GtpEchoV2 {
-        int spare1:3;
-        int has_teid:1;
-        int piggyback:1;
-        int version:3;
-
-        uint8_t msg;
-        uint16_t len;
-        union {
-                uint16_t seq;
-                struct {
-                        uint32_t teid;
-                        uint16_t seq;
-                } s;
-        } u2;
-        uint16_t spare2;
-};
-#pragma pack()
-struct GtpReply {
-        int ok;
+struct GtpHeader {
+        int ok;                      /* decoded: packet was long enough */
 
         int version;
+        int flags;                   /* flags octet without version */
         int msg;
         int len;
 
@@ -70,17 +75,318 @@ struct GtpReply {
 
         int has_ext_head;
         uint8_t next;
+
+        size_t ieOff;                /* decoded: where IEs start */
+        size_t ieLen;                /* and how many bytes of them */
+        int badExt;                  /* decoded: extension headers broken */
+};
+
+/**
+ * Information element, see gtpIeNext(). value points into the packet.
+ */
+struct GtpIe {
+        unsigned int type;
+        unsigned int instance;       /* GTPv2 only */
+        const unsigned char *value;
+        size_t len;
+};
+struct GtpIeIter {
+        int version;
+        const unsigned char *p;
+        const unsigned char *end;
 };
 
 enum {
         GTPMSG_ECHO = 1,
         GTPMSG_ECHOREPLY = 2,
+        GTPMSG_ERRORIND = 26,        /* GTP-U */
+        GTPMSG_SUPPEXTHDR = 31,      /* supported extension headers */
+};
+
+/* Why a received packet wasn't a plain echo reply. See gtpDecodeBatch() */
+enum {
+        GTP_ANOMALY_SHORT,           /* shorter than header, ignored */
+        GTP_ANOMALY_VERSION,         /* not GTPv1 or v2, ignored */
+        GTP_ANOMALY_MSG,             /* not a message we handle, ignored */
+        GTP_ANOMALY_LENGTH,          /* length field is not packet size */
+        GTP_ANOMALY_PIGGYBACK,       /* GTPv2 piggyback flag */
+        GTP_ANOMALY_IE,              /* malformed IEs or extension headers */
+        GTP_ANOMALIES
+};
+
+/* Send times and got-reply bits are kept per target for the last
+ * windowSize pings, enough to cover its wait time at the current send
+ * rate. Replies to pings older than that are considered lost.
+ * Sizes are powers of 2.
+ */
+#define WINDOW_MIN 64
+#define WINDOW_MAX 65536     /* no more than the 16 bit seq can tell apart */
+
+/* Full sequence numbers are 32 bits and wrap after a day or so of -f.
+ * a is before b if it's less than 2^31 behind it */
+#define SEQ_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+/* with batched sends, flood mode without -i sends this many pings
+ * back-to-back per loop
+ */
+#define FLOOD_BURST 32
+
+/* pings sent before their send lag is counted, see noteSendLag() */
+#define SENDLAG_PENDING 256
+
+/* max packets read per doRecvBatch() call */
+#define RECV_BATCH 32
+
+/**
+ * Log-linear histogram of times (ns). See histogram.c
+ */
+#define HISTOGRAM_SUBBITS 7            /* <1% bucket width */
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUBBITS)
+#define HISTOGRAM_MAXBITS 36           /* ~68s */
+#define HISTOGRAM_BUCKETS \
+        ((HISTOGRAM_MAXBITS - HISTOGRAM_SUBBITS + 1) * HISTOGRAM_SUB)
+struct Histogram {
+        uint64_t count;
+        uint32_t counts[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Compact quantile sketch of times (ns), for -A. See sketch.c
+ */
+#define SKETCH_BINS 256
+struct Sketch {
+        uint64_t count;
+        uint32_t zero;               /* values <= 0 */
+        int offset;                  /* key of bins[0] */
+        int minKey;
+        int maxKey;
+        uint32_t bins[SKETCH_BINS];
+};
+
+/**
+ * RFC 4737 reordering state of one target. See reorder.c
+ */
+#define REORDER_HISTORY 64     /* in-order replies remembered, for extent */
+#define REORDER_N 4            /* n-reordering counted for n = 1..4 */
+struct ReorderMark {
+        unsigned int seq;
+        unsigned int arrival;
+        int64_t time;
+};
+struct Reorder {
+        unsigned int nextExp;
+        unsigned int arrivals;
+        struct ReorderMark history[REORDER_HISTORY];
+        unsigned int historyHead;    /* oldest */
+        unsigned int historyLen;
+        unsigned int recent[REORDER_N];  /* seq of last REORDER_N replies */
+};
+struct ReorderSample {
+        int reordered;
+        unsigned int extent;         /* replies since first higher seq */
+        int64_t late;                /* ns since first higher seq */
+        unsigned int n;              /* n-reordered for 1..n */
+        unsigned int gap;            /* seq skipped by in-order reply */
+};
+
+/**
+ * Loss pattern state of one target. See loss.c
+ */
+#define LOSS_GMIN 16           /* received pings that end a burst */
+#define LOSS_RUNBUCKETS 24     /* run lengths 1, 2-3, 4-7, ... */
+struct Loss {
+        unsigned int next;           /* next seq to classify */
+        int runLost;                 /* current run */
+        unsigned int runLen;
+        int haveLoss;
+        unsigned int sinceLoss;      /* received since last loss */
+        unsigned int burstPkts;      /* open burst, 0 = none */
+        unsigned int burstLost;
+        int burstAfterGap;           /* open burst has gap pings before */
+        int lossFirst;               /* last loss was the first ping */
+};
+struct LossStats {
+        unsigned int classified;     /* pings known received or lost */
+        unsigned int classifiedLost;
+        unsigned int lossRuns[LOSS_RUNBUCKETS];
+        unsigned int goodRuns[LOSS_RUNBUCKETS];
+        unsigned int lossRunMax;
+        unsigned int goodRunMax;
+        unsigned int bursts;
+        unsigned int gapBursts;      /* bursts with gap pings before */
+        unsigned int burstPkts;
+        unsigned int burstLost;
+};
+
+/**
+ * ping statistics, per target
+ */
+struct Stats {
+        unsigned int sent;
+        unsigned int recvd;
+        unsigned int dups;
+        unsigned int reorder;        /* reordered replies, RFC 4737 */
+        unsigned int restarts;       /* peer restart counter changed */
+        unsigned int errorInds;      /* GTP-U error indications */
+        unsigned int totalTimeCount;
+        int64_t totalTime;
+        uint64_t totalTimeSquaredHi;  /* sum of squares, 128 bits */
+        uint64_t totalTimeSquaredLo;
+        int64_t totalMin;
+        int64_t totalMax;
+        struct Histogram *hist;      /* allocated on first sample */
+        struct Sketch *sketch;       /* instead of hist with -A, same */
+
+        /* RFC 5481 IPDV, between pings with consecutive seq */
+        unsigned int ipdvCount;
+        int64_t ipdvAbsSum;
+        int64_t ipdvMin;
+        int64_t ipdvMax;
+
+        /* RFC 4737 reordering, see reorder.c */
+        uint64_t reorderExtentSum;
+        unsigned int reorderExtentMax;
+        int64_t reorderLateSum;
+        int64_t reorderLateMax;
+        unsigned int nReordered[REORDER_N];
+        unsigned int gaps;
+        uint64_t gapSum;
+        unsigned int gapMax;
+
+        struct LossStats loss;       /* loss pattern, see loss.c */
+};
+
+/**
+ * Everything we know about one GSN we're pinging.
+ */
+struct Target {
+        char *target;                /* name as given by user */
+        char *targetip;              /* resolved, numeric */
+
+        /* settings. Default to what's in struct Options */
+        char *port;                  /* NULL = options.port */
+        unsigned int version;
+        int has_teid;
+        uint32_t teid;
+        int tos;
+        int64_t interval;
+        int64_t wait;                /* ns, -w or autowait from our RTTs */
+
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        int fd;                      /* socket used to reach target */
+        int connected;               /* fd is connect()ed to addr */
+
+        unsigned char *packet;       /* echo request, see mkping() */
+        size_t packetLen;
+        size_t packetSeqOff;         /* where in packet the seq goes */
+
+        unsigned int curSeq;
+        int restartCounter;          /* peer's Recovery IE, -1 = not seen */
+        struct Reorder reorder;
+        struct Loss loss;            /* up to the wait time, see loss.c */
+        struct Loss lossDone;        /* pings no longer in the window */
+        struct LossStats lossDoneStats;
+        int64_t nextPingTime;        /* when next ping is due */
+        int64_t lastPingTime;
+        int64_t lastRecvTime;
+        int64_t *sendTimes;          /* RTT data, windowSize slots */
+        int64_t *rtts;               /* of replied pings, for IPDV */
+        uint32_t *gotIt;             /* duplicate-check bitmap */
+        unsigned int windowSize;
+        struct Stats stats;
+        int64_t jitter;              /* RFC 3550, ns scaled by 16 */
+        int64_t prevRtt;             /* last reply, for jitter */
+        int hasPrevRtt;
+        struct Stats interim;        /* since last interim report */
+        unsigned int interimEpoch;   /* see targetInterim() */
+
+        /* TargetTable internals */
+        struct Target *hashNext;
+        size_t heapIndex;
+
+        /* resolver internals */
+        struct Target *resolveNext;
+        int resolveErr;
+};
+
+/**
+ * Target list file being read. See targetlist.c for format.
+ */
+struct TargetList {
+        const char *filename;
+        int fd;
+        int eof;
+        int skipLine;                /* rest of overlong line */
+        unsigned int lineno;
+        size_t pos;                  /* start of next line in buf */
+        size_t len;                  /* bytes used in buf */
+        char buf[65536];
+};
+
+/**
+ * All targets, indexed by address and by send deadline.
+ */
+struct TargetTable {
+        struct Target **targets;
+        size_t num;
+        size_t alloc;
+
+        struct Target **hash;        /* chained, hashSize is power of 2 */
+        size_t hashSize;
+
+        struct Target **heap;        /* min-heap on nextPingTime */
+        size_t heapLen;
+};
+
+/**
+ * Something happened on an fd. See eventloop_*.c
+ */
+enum {
+        EVENT_READ = 1,
+        EVENT_ERROR = 2,
+};
+struct Event {
+        int fd;
+        int events;
+};
+
+/**
+ * A received packet, from doRecvBatch() or batchioNextPacket(). The
+ * batchio ones can also be receive or send errors.
+ */
+struct RecvPacket {
+        int fd;
+        int err;                     /* errno, if receive or send failed */
+        int sendErr;                 /* err is from a send */
+        const char *data;
+        size_t len;
+        int ttl;
+        int tos;
+        struct sockaddr_storage from;
+        socklen_t fromlen;
+        int64_t time;                /* when it was received */
+};
+
+/**
+ * Headers of up to RECV_BATCH received packets, one array per field.
+ * Only valid[] is set for packets that weren't GTPv1 or v2 headers.
+ */
+struct GtpBatch {
+        unsigned char valid[RECV_BATCH];
+        unsigned char version[RECV_BATCH];
+        unsigned char msg[RECV_BATCH];
+        uint16_t seq[RECV_BATCH];
+        uint32_t teid[RECV_BATCH];
+        int16_t recovery[RECV_BATCH]; /* restart counter, -1 = none */
 };
 
 /**
  * options
  */
 #define DEFAULT_PORT "2123"
+#define DEFAULT_PORT_GTPU "2152"
+#define MAX_PADTO 65507              /* biggest UDP payload over IPv4 */
 #define DEFAULT_VERBOSE 0
 #define DEFAULT_GTPVERSION 1
 #define DEFAULT_INTERVAL 1.0
@@ -90,14 +396,13 @@ struct Options {
         const char *port;
         int verbose;
         int flood;
-        double interval;
-        double wait;
+        int64_t interval;            /* ns */
+        int64_t wait;                /* ns */
         int autowait;
+        int64_t report;              /* ns, 0 = only on SIGQUIT/SIGUSR1 */
         unsigned long count;
         int has_teid;
         uint32_t teid;
-        const char *target;
-        char *targetip;
         int ttl;
         int tos;
         int af;
@@ -106,20 +411,146 @@ struct Options {
         int traceroutehops;
         const char *source;
         const char *source_port;
+        const char *targetlist;
+        unsigned int threads;
+        double sketch;               /* -A accuracy, 0 = use histogram */
+        int gtpu;                    /* -u */
+        unsigned int firstExt;       /* -e, type of first extension header */
+        unsigned char *ext;          /* -e, the chain of them, encoded */
+        size_t extLen;
+        size_t padTo;                /* -z, 0 = no padding */
 };
 
 extern struct Options options;
 extern const char *argv0;
 
-ssize_t doRecv(int sock, void *data, size_t len, int *ttl, int *tos);
+int doRecvBatch(int sock, struct RecvPacket *pkts, int maxPkts);
+void doRecvParseCmsg(struct msghdr *msgh, int *ttl, int *tos, int64_t *when);
 
 void errInspectionPrintSummary();
+unsigned int errInspectionCount();
+void errInspectionMerge(unsigned int count);
 void errInspectionInit(int fd, const struct addrinfo *addrs);
-int handleRecvErr(int fd, const char *reason, double lastPingTime);
+void errInspectionTxTimestamps(int fd);
+int handleRecvErr(int fd, const char *reason, int64_t lastPingTime);
+void handleTxTimestamp(const void *packet, size_t len, int64_t when);
 const char *tos2String(int tos, char *buf, size_t buflen);
 struct addrinfo* getIfAddrs(const struct addrinfo *dest);
 int sockaddrlen(int af);
-double clock_get_dbl();
+int64_t clock_get_ns();
+int64_t clock_from_realtime(int64_t realtime);
+
+void statsInit(struct Stats *s);
+void statsClear(struct Stats *s);
+void statsFree(struct Stats *s);
+int64_t statsPercentile(const struct Stats *s, double percent);
+void statsAddRtt(struct Stats *s, int64_t rtt);
+void statsMerge(struct Stats *dst, const struct Stats *src);
+void statsPrintTimes(const char *what, const struct Stats *s);
+void statsPrintRtt(const struct Stats *s);
+void statsPrintPercentiles(const char *what, const struct Stats *s);
+void statsAddIpdv(struct Stats *s, int64_t ipdv);
+void statsPrintDelayVar(const struct Stats *s, int64_t jitter);
+
+int reorderAdd(struct Reorder *r, unsigned int seq, int64_t now,
+               struct ReorderSample *rs);
+void statsAddReorder(struct Stats *s, const struct ReorderSample *rs);
+void statsMergeReorder(struct Stats *dst, const struct Stats *src);
+int statsPrintReorder(const struct Stats *s);
+
+void lossAdd(struct Loss *l, int lost, struct LossStats *s1,
+             struct LossStats *s2);
+void lossFinish(struct Loss *l, struct LossStats *s);
+void lossStatsMerge(struct LossStats *dst, const struct LossStats *src);
+void lossStatsRedo(struct LossStats *dst, const struct LossStats *total,
+                   const struct LossStats *done, const struct LossStats *now);
+void statsMergeLoss(struct Stats *dst, const struct Stats *src);
+int statsPrintLoss(const struct Stats *s);
+
+void sketchSetAccuracy(double accuracy);
+void sketchInit(struct Sketch *sk);
+void sketchAdd(struct Sketch *sk, int64_t v);
+void sketchMerge(struct Sketch *dst, const struct Sketch *src);
+int64_t sketchPercentile(const struct Sketch *sk, double percent);
+
+void histogramInit(struct Histogram *h);
+void histogramAdd(struct Histogram *h, int64_t v);
+void histogramMerge(struct Histogram *dst, const struct Histogram *src);
+int64_t histogramPercentile(const struct Histogram *h, double percent);
+
+const struct GtpLayout *gtpLayout(unsigned int flags);
+size_t gtpEncode(unsigned char *buf, const struct GtpHeader *h);
+size_t gtpDecode(const void *packet, size_t packetlen, struct GtpHeader *h);
+void gtpSetLength(unsigned char *buf, size_t msglen);
+size_t gtpPutExt(unsigned char *buf, const void *content, size_t len);
+size_t gtpPutIe(unsigned char *buf, int version, unsigned int type,
+                const void *value, size_t len);
+void gtpIeStart(struct GtpIeIter *it, int version, const void *ies,
+                size_t len);
+int gtpIeNext(struct GtpIeIter *it, struct GtpIe *ie);
+int gtpRecovery(int version, const void *ies, size_t len);
+void gtpDecodeBatch(const struct RecvPacket *pkts, int n, struct GtpBatch *b,
+                    unsigned int *anomalies);
+
+struct Target *targetNew(const char *name);
+void targetFree(struct Target *t);
+struct Stats *targetInterim(struct Target *t);
+void targetAddDelayVar(struct Target *t, unsigned int seq, int64_t rtt);
+int64_t targetJitter(const struct Target *t);
+void targetLossAge(struct Target *t, unsigned int end, unsigned int keep,
+                   int64_t now);
+void targetLossUndo(struct Target *t, unsigned int seq);
+void targetLossFinish(struct Target *t);
+void targetInterimRotate();
+unsigned int targetWindowWant(const struct Target *t, unsigned int seq,
+                              int64_t now);
+int targetWindowResize(struct Target *t, unsigned int size, unsigned int seq);
+int64_t *targetWindowSendTime(struct Target *t, unsigned int seq);
+int64_t *targetWindowStart(struct Target *t, unsigned int seq);
+unsigned int targetSeqExtend(const struct Target *t, uint16_t seq);
+int targetWindowHas(const struct Target *t, unsigned int seq);
+int targetWindowGotIt(const struct Target *t, unsigned int seq);
+int targetWindowSetGotIt(struct Target *t, unsigned int seq);
+int sockaddrEqual(const struct sockaddr *a, const struct sockaddr *b);
+void targetTableInit(struct TargetTable *tt);
+void targetTableFree(struct TargetTable *tt);
+void targetTableClear(struct TargetTable *tt);
+int targetTableAdd(struct TargetTable *tt, struct Target *t);
+struct Target *targetTableLookup(const struct TargetTable *tt,
+                                 const struct sockaddr *sa);
+void targetTableSchedule(struct TargetTable *tt, struct Target *t);
+struct Target *targetTableNext(const struct TargetTable *tt);
+void targetTableReschedule(struct TargetTable *tt, struct Target *t);
+void targetTableUnschedule(struct TargetTable *tt, struct Target *t);
+
+int targetListOpen(struct TargetList *tl, const char *filename);
+void targetListClose(struct TargetList *tl);
+int targetListFill(struct TargetList *tl);
+char *targetListNextLine(struct TargetList *tl);
+struct Target *targetListParseLine(struct TargetList *tl, char *line);
+int string2Tos(const char *instr);
+
+int resolveTarget(struct Target *t, int numericOnly);
+void resolverSubmit(struct Target *t);
+struct Target *resolverCollect();
+size_t resolverPending();
+int resolverFd();
+
+int workersMax();
+void workersRun(size_t num, void *(*fn)(void*), void **args);
+
+int eventLoopAdd(int fd, int edge);
+void eventLoopDel(int fd);
+int eventLoopWait(int64_t deadline, struct Event *events, int maxEvents);
+
+int batchioInit();
+int batchioFd();
+int batchioAddSocket(int fd);
+ssize_t batchioSend(int fd, const void *packet, size_t len,
+                    const struct sockaddr *to, socklen_t tolen,
+                    int64_t *sendTime);
+void batchioFlush();
+int batchioNextPacket(struct RecvPacket *p);
 
 /* ---- Emacs Variables ----
  * Local Variables:
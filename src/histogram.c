@@ -0,0 +1,152 @@
+/** gtping/histogram.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Fixed size log-linear histogram of times (ns), for percentiles.
+ *
+ * Values below HISTOGRAM_SUB get a bucket each. Above that, every power
+ * of 2 is split into HISTOGRAM_SUB equal buckets, so a bucket is never
+ * wider than 1/HISTOGRAM_SUB of the values in it. Adding a value is a
+ * few shifts and an increment, and two histograms are merged by adding
+ * the counts.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "gtping.h"
+
+/**
+ * return index of highest bit set. v must not be 0.
+ */
+static int
+msb(uint64_t v)
+{
+#ifdef __GNUC__
+        return 63 - __builtin_clzll(v);
+#else
+        int ret = 0;
+        while (v >>= 1) {
+                ret++;
+        }
+        return ret;
+#endif
+}
+
+/**
+ * return bucket for value v. Too large values go in the last bucket.
+ */
+static unsigned int
+histogramBucket(int64_t v)
+{
+        int shift;
+
+        if (v < HISTOGRAM_SUB) {
+                return v < 0 ? 0 : (unsigned int)v;
+        }
+        if (v >= (int64_t)1 << HISTOGRAM_MAXBITS) {
+                return HISTOGRAM_BUCKETS - 1;
+        }
+        shift = msb(v) - HISTOGRAM_SUBBITS;
+        return (shift + 1) * HISTOGRAM_SUB
+                + (unsigned int)(v >> shift) - HISTOGRAM_SUB;
+}
+
+/**
+ * return middle of the values that go in 'bucket'.
+ */
+static int64_t
+histogramValue(unsigned int bucket)
+{
+        int shift;
+        int64_t low;
+
+        if (bucket < HISTOGRAM_SUB) {
+                return bucket;
+        }
+        shift = bucket / HISTOGRAM_SUB - 1;
+        low = (int64_t)(bucket % HISTOGRAM_SUB + HISTOGRAM_SUB) << shift;
+        return low + (((int64_t)1 << shift) >> 1);
+}
+
+/**
+ *
+ */
+void
+histogramInit(struct Histogram *h)
+{
+        memset(h, 0, sizeof(struct Histogram));
+}
+
+/**
+ * Count one value.
+ */
+void
+histogramAdd(struct Histogram *h, int64_t v)
+{
+        h->counts[histogramBucket(v)]++;
+        h->count++;
+}
+
+/**
+ * Add the counts of 'src' to 'dst'.
+ */
+void
+histogramMerge(struct Histogram *dst, const struct Histogram *src)
+{
+        unsigned int c;
+
+        if (!src->count) {
+                return;
+        }
+        for (c = 0; c < HISTOGRAM_BUCKETS; c++) {
+                dst->counts[c] += src->counts[c];
+        }
+        dst->count += src->count;
+}
+
+/**
+ * Value that 'percent' % of the counted values are at or below.
+ *
+ * return -1 if there are no values.
+ */
+int64_t
+histogramPercentile(const struct Histogram *h, double percent)
+{
+        double rank;
+        uint64_t want;
+        uint64_t seen = 0;
+        unsigned int c;
+
+        if (!h->count) {
+                return -1;
+        }
+        /* nearest rank */
+        rank = percent / 100.0 * h->count;
+        want = (uint64_t)rank;
+        if (want < rank) {
+                want++;
+        }
+        if (want < 1) {
+                want = 1;
+        }
+        if (want > h->count) {
+                want = h->count;
+        }
+        for (c = 0; c < HISTOGRAM_BUCKETS; c++) {
+                seen += h->counts[c];
+                if (seen >= want) {
+                        break;
+                }
+        }
+        return histogramValue(c);
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
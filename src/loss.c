@@ -0,0 +1,325 @@
+/** gtping/loss.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Loss pattern: how lost pings are spread out, not just how many.
+ *
+ * Once a ping is older than -w, or without -w once it's out of the
+ * tracking window, it's either received or lost, and is fed here in
+ * sequence order (see targetLossAge()). Lengths of runs of lost and
+ * received pings are counted in power-of-2 buckets.
+ *
+ * Losses are also split into bursts and gaps like RFC 3611 does: a burst
+ * is losses with fewer than LOSS_GMIN received pings between them,
+ * everything else is gap. From that comes a Gilbert-Elliott model:
+ *   p    chance of going from gap to burst, per ping in gap. A burst
+ *        that starts at the first ping didn't come from gap, and isn't
+ *        counted here.
+ *   r    chance of going from burst to gap, per ping in burst
+ *   1-k  loss rate in gap
+ *   1-h  loss rate in burst
+ *
+ * State is a handful of counters, whatever the run lengths.
+ *
+ * A reply can come after -w while its ping is still in the window. Then
+ * the pings since the last one out of the window are fed again, and the
+ * counters adjusted with lossStatsRedo(). See targetLossUndo().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gtping.h"
+
+/**
+ * return bucket for run length n >= 1: 1, 2-3, 4-7, ...
+ */
+static unsigned int
+runBucket(unsigned int n)
+{
+        unsigned int b = 0;
+
+        while (n >>= 1) {
+                b++;
+        }
+        return b < LOSS_RUNBUCKETS ? b : LOSS_RUNBUCKETS - 1;
+}
+
+/**
+ * Count a finished run in s, if s is not NULL.
+ */
+static void
+statsAddRun(struct LossStats *s, int lost, unsigned int len)
+{
+        if (!s) {
+                return;
+        }
+        if (lost) {
+                s->lossRuns[runBucket(len)]++;
+                if (len > s->lossRunMax) {
+                        s->lossRunMax = len;
+                }
+        } else {
+                s->goodRuns[runBucket(len)]++;
+                if (len > s->goodRunMax) {
+                        s->goodRunMax = len;
+                }
+        }
+}
+
+/**
+ * Count a finished burst in s, if s is not NULL.
+ */
+static void
+statsAddBurst(struct LossStats *s, unsigned int pkts, unsigned int lost,
+              int afterGap)
+{
+        if (!s) {
+                return;
+        }
+        s->bursts++;
+        s->gapBursts += !!afterGap;
+        s->burstPkts += pkts;
+        s->burstLost += lost;
+}
+
+/**
+ * Next ping in sequence was received (lost = 0) or lost (lost = 1).
+ * Counted in s1 and, if not NULL, s2.
+ */
+void
+lossAdd(struct Loss *l, int lost, struct LossStats *s1, struct LossStats *s2)
+{
+        int first = !l->runLen;
+
+        s1->classified++;
+        s1->classifiedLost += lost;
+        if (s2) {
+                s2->classified++;
+                s2->classifiedLost += lost;
+        }
+
+        if (l->runLen && l->runLost != lost) {
+                statsAddRun(s1, l->runLost, l->runLen);
+                statsAddRun(s2, l->runLost, l->runLen);
+                l->runLen = 0;
+        }
+        l->runLost = lost;
+        l->runLen++;
+
+        if (!lost) {
+                l->sinceLoss++;
+                if (l->burstPkts && l->sinceLoss == LOSS_GMIN) {
+                        statsAddBurst(s1, l->burstPkts, l->burstLost,
+                                      l->burstAfterGap);
+                        statsAddBurst(s2, l->burstPkts, l->burstLost,
+                                      l->burstAfterGap);
+                        l->burstPkts = l->burstLost = 0;
+                }
+                return;
+        }
+        if (l->haveLoss && l->sinceLoss < LOSS_GMIN) {
+                if (!l->burstPkts) {
+                        /* burst starts with the previous loss */
+                        l->burstPkts = l->burstLost = 1;
+                        l->burstAfterGap = !l->lossFirst;
+                }
+                l->burstPkts += l->sinceLoss + 1;
+                l->burstLost++;
+        }
+        l->haveLoss = 1;
+        l->lossFirst = first;
+        l->sinceLoss = 0;
+}
+
+/**
+ * No more pings. Count the runs and burst still open in s.
+ */
+void
+lossFinish(struct Loss *l, struct LossStats *s)
+{
+        if (l->runLen) {
+                statsAddRun(s, l->runLost, l->runLen);
+                l->runLen = 0;
+        }
+        if (l->burstPkts) {
+                statsAddBurst(s, l->burstPkts, l->burstLost,
+                              l->burstAfterGap);
+                l->burstPkts = l->burstLost = 0;
+        }
+}
+
+/**
+ * Add the counters of 'src' to 'dst'.
+ */
+void
+lossStatsMerge(struct LossStats *dst, const struct LossStats *src)
+{
+        unsigned int c;
+
+        for (c = 0; c < LOSS_RUNBUCKETS; c++) {
+                dst->lossRuns[c] += src->lossRuns[c];
+                dst->goodRuns[c] += src->goodRuns[c];
+        }
+        if (src->lossRunMax > dst->lossRunMax) {
+                dst->lossRunMax = src->lossRunMax;
+        }
+        if (src->goodRunMax > dst->goodRunMax) {
+                dst->goodRunMax = src->goodRunMax;
+        }
+        dst->classified += src->classified;
+        dst->classifiedLost += src->classifiedLost;
+        dst->bursts += src->bursts;
+        dst->gapBursts += src->gapBursts;
+        dst->burstPkts += src->burstPkts;
+        dst->burstLost += src->burstLost;
+}
+
+/**
+ * return a - (total - done) + now, or 0 if that's negative.
+ */
+static unsigned int
+redo(unsigned int a, unsigned int total, unsigned int done, unsigned int now)
+{
+        unsigned int was = total - done;
+
+        return a + now < was ? 0 : a + now - was;
+}
+
+/**
+ * The pings fed since 'done' were counted in 'total', and have been fed
+ * again into 'now'. Adjust 'dst', that they were also counted in, to
+ * match.
+ *
+ * A max can't be taken back, so dst's are only raised. And if dst is
+ * interim stats, some of the pings may have been in the last report
+ * already, so counters stop at 0.
+ */
+void
+lossStatsRedo(struct LossStats *dst, const struct LossStats *total,
+              const struct LossStats *done, const struct LossStats *now)
+{
+        unsigned int c;
+
+        for (c = 0; c < LOSS_RUNBUCKETS; c++) {
+                dst->lossRuns[c] = redo(dst->lossRuns[c], total->lossRuns[c],
+                                        done->lossRuns[c], now->lossRuns[c]);
+                dst->goodRuns[c] = redo(dst->goodRuns[c], total->goodRuns[c],
+                                        done->goodRuns[c], now->goodRuns[c]);
+        }
+        if (now->lossRunMax > dst->lossRunMax) {
+                dst->lossRunMax = now->lossRunMax;
+        }
+        if (now->goodRunMax > dst->goodRunMax) {
+                dst->goodRunMax = now->goodRunMax;
+        }
+        dst->classified = redo(dst->classified, total->classified,
+                               done->classified, now->classified);
+        dst->classifiedLost = redo(dst->classifiedLost,
+                                   total->classifiedLost,
+                                   done->classifiedLost,
+                                   now->classifiedLost);
+        dst->bursts = redo(dst->bursts, total->bursts,
+                           done->bursts, now->bursts);
+        dst->gapBursts = redo(dst->gapBursts, total->gapBursts,
+                              done->gapBursts, now->gapBursts);
+        dst->burstPkts = redo(dst->burstPkts, total->burstPkts,
+                              done->burstPkts, now->burstPkts);
+        dst->burstLost = redo(dst->burstLost, total->burstLost,
+                              done->burstLost, now->burstLost);
+}
+
+/**
+ * Add the loss pattern counters of 'src' to 'dst'. Called from
+ * statsMerge().
+ */
+void
+statsMergeLoss(struct Stats *dst, const struct Stats *src)
+{
+        lossStatsMerge(&dst->loss, &src->loss);
+}
+
+/**
+ * print "<what> runs n/max = ... (1:x 2-3:y ...)", or "<what> runs none"
+ * if no run has ended yet.
+ */
+static void
+printRuns(const char *what, const unsigned int *runs, unsigned int max)
+{
+        const char *sep = "";
+        unsigned int n = 0;
+        unsigned int c;
+
+        for (c = 0; c < LOSS_RUNBUCKETS; c++) {
+                n += runs[c];
+        }
+        if (!n) {
+                printf("%s runs none", what);
+                return;
+        }
+        printf("%s runs n/max = %u/%u (", what, n, max);
+        for (c = 0; c < LOSS_RUNBUCKETS; c++) {
+                if (!runs[c]) {
+                        continue;
+                }
+                if (c == 0) {
+                        printf("1:%u", runs[c]);
+                } else {
+                        printf("%s%u-%u:%u",
+                               sep, 1U << c, (2U << c) - 1, runs[c]);
+                }
+                sep = " ";
+        }
+        printf(")");
+}
+
+/**
+ * print "loss runs ..., good runs ..., Gilbert-Elliott p/r/1-k/1-h = ..."
+ * if any ping has been found lost.
+ *
+ * return true if something was printed.
+ */
+int
+statsPrintLoss(const struct Stats *s)
+{
+        const struct LossStats *l = &s->loss;
+        unsigned int gapPkts;
+        unsigned int gapLost;
+        char p[16];
+
+        if (!l->classifiedLost) {
+                return 0;
+        }
+        printRuns("loss", l->lossRuns, l->lossRunMax);
+        printf(", ");
+        printRuns("good", l->goodRuns, l->goodRunMax);
+
+        /* in interim stats a burst can have started in an earlier
+         * report window */
+        gapPkts = l->classified > l->burstPkts
+                ? l->classified - l->burstPkts : 0;
+        gapLost = l->classifiedLost > l->burstLost
+                ? l->classifiedLost - l->burstLost : 0;
+        /* no gap pings, no chance of leaving gap */
+        if (gapPkts) {
+                snprintf(p, sizeof(p), "%.4f",
+                         (double)l->gapBursts / gapPkts);
+        } else {
+                strcpy(p, "-");
+        }
+        printf(", Gilbert-Elliott p/r/1-k/1-h = %s/%.4f/%.4f/%.4f", p,
+               l->burstPkts ? (double)l->bursts / l->burstPkts : 1.0,
+               gapPkts ? (double)gapLost / gapPkts : 0.0,
+               l->burstPkts ? (double)l->burstLost / l->burstPkts : 0.0);
+        return 1;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -17,28 +17,50 @@
 #include"gtping.h"
 
 /**
- *
+ * Nanoseconds since some arbitrary point.
  */
-double
-clock_get_dbl()
+int64_t
+clock_get_ns()
 {
         struct timespec ts;
         struct timeval tv;
 
         /* try clock_gettime() */
         if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
-                return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+                return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
         }
         fprintf(stderr, "%s: clock_gettime(CLOCK_MONOTONIC,): %s\n",
                 argv0, strerror(errno));
 
         /* try gettimeofday() */
         if (!gettimeofday(&tv, NULL)) {
-                return tv.tv_sec + tv.tv_usec / 1000000.0;
+                return (int64_t)tv.tv_sec * NS_PER_SEC + tv.tv_usec * 1000;
         }
         fprintf(stderr, "%s: gettimeofday(): %s\n", argv0, strerror(errno));
 
-        return time(0);
+        return (int64_t)time(0) * NS_PER_SEC;
+}
+
+/**
+ * Convert a CLOCK_REALTIME time (ns) from the recent past, such as a
+ * kernel packet timestamp, to the clock_get_ns() clock.
+ */
+int64_t
+clock_from_realtime(int64_t realtime)
+{
+        struct timespec ts;
+        int64_t age;
+
+        if (clock_gettime(CLOCK_REALTIME, &ts)) {
+                return clock_get_ns();
+        }
+        age = (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec - realtime;
+
+        /* wall clock was stepped. Fall back to now */
+        if (age < 0 || age > 10 * NS_PER_SEC) {
+                age = 0;
+        }
+        return clock_get_ns() - age;
 }
 
 /* ---- Emacs Variables ----
@@ -16,18 +16,27 @@
 #include"gtping.h"
 
 /**
- *
+ * Nanoseconds since the epoch.
  */
-double
-clock_get_dbl()
+int64_t
+clock_get_ns()
 {
         struct timeval tv;
         if (gettimeofday(&tv, NULL)) {
                 fprintf(stderr, "%s: gettimeofday(): %s\n",
                         argv0, strerror(errno));
-                return time(0);
+                return (int64_t)time(0) * NS_PER_SEC;
         }
-        return tv.tv_sec + tv.tv_usec / 1000000.0;
+        return (int64_t)tv.tv_sec * NS_PER_SEC + tv.tv_usec * 1000;
+}
+
+/**
+ * clock_get_ns() is the wall clock here.
+ */
+int64_t
+clock_from_realtime(int64_t realtime)
+{
+        return realtime;
 }
 
 /* ---- Emacs Variables ----
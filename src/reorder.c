@@ -0,0 +1,215 @@
+/** gtping/reorder.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * RFC 4737 reordering metrics, one reply at a time.
+ *
+ * A reply is reordered if its sequence number is lower than the next one
+ * expected (one more than the highest seen so far). For reordered
+ * replies we also want:
+ *   - extent: how many replies ago the first one with a higher sequence
+ *     number arrived, and how long ago (late time offset).
+ *   - n-reordering: how many of the replies right before it all had
+ *     higher sequence numbers.
+ * And for in-order replies that skip ahead, the size of the gap.
+ *
+ * The first reply with a higher sequence number always raised the next
+ * expected number, so only those need to be remembered to find the
+ * extent. The last REORDER_HISTORY of them are kept in a ring, and the
+ * right one is found with a binary search. Everything else is O(1) per
+ * reply.
+ *
+ * Sequence numbers are compared with SEQ_BEFORE(), so they may wrap.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "gtping.h"
+
+/**
+ * History entry 'n' counting from the oldest.
+ */
+static const struct ReorderMark*
+reorderMark(const struct Reorder *r, unsigned int n)
+{
+        return &r->history[(r->historyHead + n) % REORDER_HISTORY];
+}
+
+/**
+ * Account for a non-duplicate reply to ping 'seq' received at 'now'.
+ *
+ * return 1 if it was reordered, else 0. *rs is filled in either way.
+ */
+int
+reorderAdd(struct Reorder *r, unsigned int seq, int64_t now,
+           struct ReorderSample *rs)
+{
+        unsigned int arrival = r->arrivals++;
+        unsigned int c;
+
+        memset(rs, 0, sizeof(struct ReorderSample));
+
+        if (r->historyLen && SEQ_BEFORE(seq, r->nextExp)) {
+                unsigned int lo = 0;
+                unsigned int hi = r->historyLen - 1;
+                const struct ReorderMark *m;
+
+                rs->reordered = 1;
+
+                /* earliest in-order reply with seq higher than this.
+                 * The newest one always is. If it's older than the
+                 * history then this is a lower bound */
+                while (lo < hi) {
+                        unsigned int mid = lo + (hi - lo) / 2;
+                        if (SEQ_BEFORE(seq, reorderMark(r, mid)->seq)) {
+                                hi = mid;
+                        } else {
+                                lo = mid + 1;
+                        }
+                }
+                m = reorderMark(r, lo);
+                rs->extent = arrival - m->arrival;
+                rs->late = now - m->time;
+
+                /* n-reordering */
+                for (c = 0; c < REORDER_N && c < arrival; c++) {
+                        unsigned int prev;
+                        prev = r->recent[(arrival - 1 - c) % REORDER_N];
+                        if (!SEQ_BEFORE(seq, prev)) {
+                                break;
+                        }
+                }
+                rs->n = c;
+        } else {
+                struct ReorderMark *m;
+
+                if (r->historyLen && SEQ_BEFORE(r->nextExp, seq)) {
+                        rs->gap = seq - r->nextExp;
+                }
+                if (r->historyLen < REORDER_HISTORY) {
+                        r->historyLen++;
+                } else {
+                        r->historyHead = (r->historyHead + 1)
+                                % REORDER_HISTORY;
+                }
+                m = &r->history[(r->historyHead + r->historyLen - 1)
+                                % REORDER_HISTORY];
+                m->seq = seq;
+                m->arrival = arrival;
+                m->time = now;
+                r->nextExp = seq + 1;
+        }
+        r->recent[arrival % REORDER_N] = seq;
+        return rs->reordered;
+}
+
+/**
+ * Add one reply's reordering metrics to the stats.
+ */
+void
+statsAddReorder(struct Stats *s, const struct ReorderSample *rs)
+{
+        unsigned int c;
+
+        if (rs->gap) {
+                s->gaps++;
+                s->gapSum += rs->gap;
+                if (rs->gap > s->gapMax) {
+                        s->gapMax = rs->gap;
+                }
+        }
+        if (!rs->reordered) {
+                return;
+        }
+        s->reorder++;
+        s->reorderExtentSum += rs->extent;
+        if (rs->extent > s->reorderExtentMax) {
+                s->reorderExtentMax = rs->extent;
+        }
+        s->reorderLateSum += rs->late;
+        if (rs->late > s->reorderLateMax) {
+                s->reorderLateMax = rs->late;
+        }
+        for (c = 0; c < rs->n; c++) {
+                s->nReordered[c]++;
+        }
+}
+
+/**
+ * Add the reordering counters of 'src' to 'dst'. Called from statsMerge().
+ */
+void
+statsMergeReorder(struct Stats *dst, const struct Stats *src)
+{
+        unsigned int c;
+
+        dst->reorderExtentSum += src->reorderExtentSum;
+        if (src->reorderExtentMax > dst->reorderExtentMax) {
+                dst->reorderExtentMax = src->reorderExtentMax;
+        }
+        dst->reorderLateSum += src->reorderLateSum;
+        if (src->reorderLateMax > dst->reorderLateMax) {
+                dst->reorderLateMax = src->reorderLateMax;
+        }
+        for (c = 0; c < REORDER_N; c++) {
+                dst->nReordered[c] += src->nReordered[c];
+        }
+        dst->gaps += src->gaps;
+        dst->gapSum += src->gapSum;
+        if (src->gapMax > dst->gapMax) {
+                dst->gapMax = src->gapMax;
+        }
+}
+
+/**
+ * print "reordered x%, extent avg/max = ..., late avg/max = ... ms,
+ * n-reordered 1/2/3/4 = ..., gaps n/avg/max = ..." for what there is data
+ * for. Prints nothing if nothing was reordered and no gaps were seen.
+ *
+ * return true if something was printed.
+ */
+int
+statsPrintReorder(const struct Stats *s)
+{
+        unsigned int c;
+
+        if (!s->reorder && !s->gaps) {
+                return 0;
+        }
+        if (s->reorder) {
+                printf("reordered %.2f%%, "
+                       "extent avg/max = %.1f/%u, "
+                       "late avg/max = %.3f/%.3f ms, "
+                       "n-reordered 1",
+                       s->recvd ? 100.0 * s->reorder / s->recvd : 0.0,
+                       (double)s->reorderExtentSum / s->reorder,
+                       s->reorderExtentMax,
+                       NS2MS((double)s->reorderLateSum / s->reorder),
+                       NS2MS(s->reorderLateMax));
+                for (c = 1; c < REORDER_N; c++) {
+                        printf("/%u", c + 1);
+                }
+                for (c = 0; c < REORDER_N; c++) {
+                        printf("%s%u", c ? "/" : " = ", s->nReordered[c]);
+                }
+        }
+        if (s->gaps) {
+                printf("%sgaps n/avg/max = %u/%.1f/%u",
+                       s->reorder ? ", " : "",
+                       s->gaps,
+                       (double)s->gapSum / s->gaps,
+                       s->gapMax);
+        }
+        return 1;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
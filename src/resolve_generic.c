@@ -0,0 +1,82 @@
+/** gtping/src/resolve_generic.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Resolve target names one at a time, for systems without threads.
+ * Same interface as resolve_pthread.c, but resolverSubmit() blocks.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "gtping.h"
+
+static struct Target *doneHead = 0;
+static struct Target *doneTail = 0;
+static size_t pending = 0;
+
+/**
+ * Resolve target now. It will be returned by resolverCollect(), with
+ * t->resolveErr set to the return value of resolveTarget().
+ */
+void
+resolverSubmit(struct Target *t)
+{
+        t->resolveErr = resolveTarget(t, 0);
+        t->resolveNext = NULL;
+        if (doneTail) {
+                doneTail->resolveNext = t;
+        } else {
+                doneHead = t;
+        }
+        doneTail = t;
+        pending++;
+}
+
+/**
+ * Get one target that's done resolving.
+ *
+ * return NULL if there is none.
+ */
+struct Target*
+resolverCollect()
+{
+        struct Target *t;
+
+        if (!(t = doneHead)) {
+                return NULL;
+        }
+        if (!(doneHead = t->resolveNext)) {
+                doneTail = NULL;
+        }
+        t->resolveNext = NULL;
+        pending--;
+        return t;
+}
+
+/**
+ * return number of submitted targets not yet collected.
+ */
+size_t
+resolverPending()
+{
+        return pending;
+}
+
+/**
+ * Nothing to wait for, everything is resolved when submitted.
+ */
+int
+resolverFd()
+{
+        return -1;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,265 @@
+/** gtping/src/resolve_pthread.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Resolve target names in a pool of threads, so that thousands of names
+ * don't have to be looked up one after the other before pinging starts.
+ *
+ * Only the main thread calls resolverSubmit() and resolverCollect(). Worker
+ * threads take targets from the request queue, call resolveTarget() and put
+ * them on the done queue. A byte is written to a pipe for every finished
+ * target so that the main loop wakes up from poll().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gtping.h"
+
+/* getaddrinfo() mostly waits for the network, so this can be a lot more
+ * than the number of CPUs */
+#define RESOLVER_MAX_THREADS 32
+
+/**
+ * FIFO of targets, linked on t->resolveNext.
+ */
+struct ResolveQueue {
+        struct Target *head;
+        struct Target *tail;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct ResolveQueue requests;  /* protected by lock */
+static struct ResolveQueue done;      /* protected by lock */
+static unsigned int numThreads = 0;   /* protected by lock */
+static unsigned int idleThreads = 0;  /* protected by lock */
+
+/* main thread only */
+static int notifyPipe[2] = { -1, -1 };
+static size_t pending = 0;
+
+/**
+ *
+ */
+static void
+queuePush(struct ResolveQueue *q, struct Target *t)
+{
+        t->resolveNext = NULL;
+        if (q->tail) {
+                q->tail->resolveNext = t;
+        } else {
+                q->head = t;
+        }
+        q->tail = t;
+}
+
+/**
+ *
+ */
+static struct Target*
+queuePop(struct ResolveQueue *q)
+{
+        struct Target *t;
+        if (!(t = q->head)) {
+                return NULL;
+        }
+        if (!(q->head = t->resolveNext)) {
+                q->tail = NULL;
+        }
+        t->resolveNext = NULL;
+        return t;
+}
+
+/**
+ *
+ */
+static void*
+resolverThread(void *unused)
+{
+        unused = unused; /* silence warning */
+        pthread_mutex_lock(&lock);
+        for (;;) {
+                struct Target *t;
+                while (!(t = queuePop(&requests))) {
+                        idleThreads++;
+                        pthread_cond_wait(&cond, &lock);
+                        idleThreads--;
+                }
+                pthread_mutex_unlock(&lock);
+
+                t->resolveErr = resolveTarget(t, 0);
+
+                pthread_mutex_lock(&lock);
+                queuePush(&done, t);
+                while (1 != write(notifyPipe[1], "", 1)) {
+                        if (errno != EINTR) {
+                                /* pipe full. Main loop will get the
+                                 * target on one of the other bytes */
+                                break;
+                        }
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Set up the notification pipe. Threads are started on demand.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+static int
+resolverInit()
+{
+        int c;
+
+        if (pipe(notifyPipe)) {
+                int err = errno;
+                fprintf(stderr, "%s: pipe(): %s\n", argv0, strerror(err));
+                notifyPipe[0] = notifyPipe[1] = -1;
+                return -err;
+        }
+        for (c = 0; c < 2; c++) {
+                fcntl(notifyPipe[c], F_SETFD, FD_CLOEXEC);
+                fcntl(notifyPipe[c], F_SETFL,
+                      fcntl(notifyPipe[c], F_GETFL) | O_NONBLOCK);
+        }
+        return 0;
+}
+
+/**
+ * Start another worker thread. Must be called with lock held.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+static int
+resolverStartThread()
+{
+        pthread_attr_t attr;
+        pthread_t thread;
+        sigset_t all, old;
+        int err;
+
+        /* signals (SIGINT) should go to the main thread and interrupt
+         * poll(), so block them all in the new thread */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        err = pthread_create(&thread, &attr, resolverThread, NULL);
+        pthread_attr_destroy(&attr);
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        if (err) {
+                return -err;
+        }
+        numThreads++;
+        return 0;
+}
+
+/**
+ * Queue target for resolving. It will be returned by resolverCollect() when
+ * done, with t->resolveErr set to the return value of resolveTarget().
+ */
+void
+resolverSubmit(struct Target *t)
+{
+        int err = 0;
+
+        if (notifyPipe[0] < 0) {
+                err = resolverInit();
+        }
+
+        pthread_mutex_lock(&lock);
+        if (!err
+            && idleThreads == 0
+            && numThreads < RESOLVER_MAX_THREADS) {
+                err = resolverStartThread();
+                if (err && numThreads) {
+                        /* the ones we have will get to it */
+                        err = 0;
+                }
+        }
+        if (err) {
+                /* no threads at all. Do it the slow way */
+                pthread_mutex_unlock(&lock);
+                if (options.verbose > 1) {
+                        fprintf(stderr, "%s: resolver thread: %s\n",
+                                argv0, strerror(-err));
+                }
+                t->resolveErr = resolveTarget(t, 0);
+                pthread_mutex_lock(&lock);
+                queuePush(&done, t);
+        } else {
+                queuePush(&requests, t);
+                pthread_cond_signal(&cond);
+        }
+        pending++;
+        pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Get one target that's done resolving.
+ *
+ * return NULL if there is none right now.
+ */
+struct Target*
+resolverCollect()
+{
+        char buf[256];
+        struct Target *t;
+
+        if (notifyPipe[0] < 0) {
+                return NULL;
+        }
+
+        /* drain wakeups. Whatever is on the done queue now is taken care
+         * of before the main loop waits again. */
+        while (0 < read(notifyPipe[0], buf, sizeof(buf))) {
+        }
+
+        pthread_mutex_lock(&lock);
+        t = queuePop(&done);
+        pthread_mutex_unlock(&lock);
+        if (t) {
+                pending--;
+        }
+        return t;
+}
+
+/**
+ * return number of submitted targets not yet collected.
+ */
+size_t
+resolverPending()
+{
+        return pending;
+}
+
+/**
+ * return fd that becomes readable when resolverCollect() has something,
+ * or -1 if nothing has been submitted yet.
+ */
+int
+resolverFd()
+{
+        return notifyPipe[0];
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
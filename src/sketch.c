@@ -0,0 +1,192 @@
+/** gtping/sketch.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Small quantile sketch of times (ns), used instead of the histogram in
+ * histogram.c with -A, when there are too many targets for a histogram
+ * each.
+ *
+ * Like DDSketch: value v > 0 is counted in bin ceil(log(v) / log(gamma)),
+ * where gamma = (1 + a) / (1 - a) for relative accuracy a. Any value in
+ * a bin is then within a of the value reported for it. SKETCH_BINS
+ * consecutive bins are kept, which cover values up to gamma^SKETCH_BINS
+ * apart: a factor of about 170 at 1%, e.g. 0.1 ms to 17 ms. If the
+ * values spread out over more than that, the lowest bins are folded into
+ * one, so high percentiles stay accurate and low ones get worse.
+ *
+ * Adding is O(1), except when the bins have to move, which happens at
+ * most a few times. Merging is O(SKETCH_BINS).
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <math.h>
+
+#include "gtping.h"
+
+static double sketchGamma = 0;
+static double sketchLogGamma = 0;
+
+/**
+ * Set relative accuracy for all sketches. Call before adding anything.
+ */
+void
+sketchSetAccuracy(double accuracy)
+{
+        sketchGamma = (1 + accuracy) / (1 - accuracy);
+        sketchLogGamma = log(sketchGamma);
+}
+
+/**
+ *
+ */
+void
+sketchInit(struct Sketch *sk)
+{
+        memset(sk, 0, sizeof(struct Sketch));
+}
+
+/**
+ * Move bins so that 'key' fits, folding the lowest ones if needed.
+ */
+static void
+sketchMove(struct Sketch *sk, int key)
+{
+        int lo = sk->minKey < key ? sk->minKey : key;
+        int hi = sk->maxKey > key ? sk->maxKey : key;
+        uint32_t bins[SKETCH_BINS];
+        int offset;
+        int k;
+
+        if (hi - lo < SKETCH_BINS) {
+                /* fits. Leave room on the side it grew */
+                offset = key < sk->minKey ? hi - SKETCH_BINS + 1 : lo;
+        } else {
+                offset = hi - SKETCH_BINS + 1;
+        }
+        memset(bins, 0, sizeof(bins));
+        for (k = sk->minKey; k <= sk->maxKey; k++) {
+                int to = k < offset ? offset : k;
+                bins[to - offset] += sk->bins[k - sk->offset];
+        }
+        memcpy(sk->bins, bins, sizeof(bins));
+        sk->offset = offset;
+        if (sk->minKey < offset) {
+                sk->minKey = offset;
+        }
+}
+
+/**
+ * Add n values that go in bin 'key'.
+ */
+static void
+sketchAddKey(struct Sketch *sk, int key, uint32_t n)
+{
+        if (!(sk->count - sk->zero)) {
+                sk->offset = key - SKETCH_BINS / 2;
+                sk->minKey = sk->maxKey = key;
+        }
+        /* too low with the highest already at the top gets folded */
+        if (key >= sk->offset + SKETCH_BINS
+            || (key < sk->offset
+                && sk->maxKey < sk->offset + SKETCH_BINS - 1)) {
+                sketchMove(sk, key);
+        }
+        if (key < sk->offset) {
+                /* folded */
+                key = sk->offset;
+        }
+        sk->bins[key - sk->offset] += n;
+        if (key < sk->minKey) {
+                sk->minKey = key;
+        }
+        if (key > sk->maxKey) {
+                sk->maxKey = key;
+        }
+        sk->count += n;
+}
+
+/**
+ * Count one value.
+ */
+void
+sketchAdd(struct Sketch *sk, int64_t v)
+{
+        if (v <= 0) {
+                sk->zero++;
+                sk->count++;
+                return;
+        }
+        sketchAddKey(sk, (int)ceil(log((double)v) / sketchLogGamma), 1);
+}
+
+/**
+ * Add the counts of 'src' to 'dst'.
+ */
+void
+sketchMerge(struct Sketch *dst, const struct Sketch *src)
+{
+        int k;
+
+        if (!src->count) {
+                return;
+        }
+        dst->zero += src->zero;
+        dst->count += src->zero;
+        if (src->count == src->zero) {
+                return;
+        }
+        for (k = src->maxKey; k >= src->minKey; k--) {
+                uint32_t n = src->bins[k - src->offset];
+                if (n) {
+                        sketchAddKey(dst, k, n);
+                }
+        }
+}
+
+/**
+ * Value that 'percent' % of the counted values are at or below, within
+ * the relative accuracy.
+ *
+ * return -1 if there are no values.
+ */
+int64_t
+sketchPercentile(const struct Sketch *sk, double percent)
+{
+        double rank;
+        uint64_t want;
+        uint64_t seen;
+        int k;
+
+        if (!sk->count) {
+                return -1;
+        }
+        /* nearest rank */
+        rank = percent / 100.0 * sk->count;
+        want = (uint64_t)rank;
+        if (want < rank) {
+                want++;
+        }
+        if (want < 1) {
+                want = 1;
+        }
+        if ((seen = sk->zero) >= want) {
+                return 0;
+        }
+        for (k = sk->minKey; k < sk->maxKey; k++) {
+                seen += sk->bins[k - sk->offset];
+                if (seen >= want) {
+                        break;
+                }
+        }
+        return (int64_t)(2 * pow(sketchGamma, k) / (sketchGamma + 1));
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
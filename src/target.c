@@ -0,0 +1,1023 @@
+/** gtping/target.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Per-target state and the table used to look targets up when pinging
+ * more than one GSN from the same process.
+ *
+ * Targets are found two ways:
+ *   - by address, when a reply arrives on a shared unconnected socket.
+ *     Chained hash table keyed on (family, address, port).
+ *   - by deadline, when it's time to send the next ping.
+ *     Binary min-heap on nextPingTime.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "gtping.h"
+
+#define TARGETTABLE_INITIAL_HASHSIZE 64
+
+/* interim stats of targets with another epoch are from an earlier report
+ * window, and are cleared when next touched */
+static THREADLOCAL unsigned int interimEpoch = 1;
+
+/**
+ *
+ */
+void
+statsInit(struct Stats *s)
+{
+        memset(s, 0, sizeof(struct Stats));
+        s->totalMin = -1;
+        s->totalMax = -1;
+}
+
+/**
+ * Like statsInit(), but keep the histogram or sketch allocated, only
+ * emptied.
+ */
+void
+statsClear(struct Stats *s)
+{
+        struct Histogram *hist = s->hist;
+        struct Sketch *sketch = s->sketch;
+
+        statsInit(s);
+        if (hist) {
+                histogramInit(hist);
+                s->hist = hist;
+        }
+        if (sketch) {
+                sketchInit(sketch);
+                s->sketch = sketch;
+        }
+}
+
+/**
+ * Free what statsAddRtt() allocated.
+ */
+void
+statsFree(struct Stats *s)
+{
+        free(s->hist);
+        free(s->sketch);
+        s->hist = NULL;
+        s->sketch = NULL;
+}
+
+/**
+ * return histogram of s, allocating it if needed. NULL if out of memory.
+ */
+static struct Histogram*
+statsHistogram(struct Stats *s)
+{
+        if (!s->hist && (s->hist = malloc(sizeof(struct Histogram)))) {
+                histogramInit(s->hist);
+        }
+        return s->hist;
+}
+
+/**
+ * return sketch of s, allocating it if needed. NULL if out of memory.
+ */
+static struct Sketch*
+statsSketch(struct Stats *s)
+{
+        if (!s->sketch && (s->sketch = malloc(sizeof(struct Sketch)))) {
+                sketchInit(s->sketch);
+        }
+        return s->sketch;
+}
+
+/**
+ * Value that 'percent' % of the RTTs are at or below, from the histogram
+ * or, with -A, the sketch.
+ *
+ * return -1 if there are no values.
+ */
+int64_t
+statsPercentile(const struct Stats *s, double percent)
+{
+        if (options.sketch) {
+                return s->sketch ? sketchPercentile(s->sketch, percent) : -1;
+        }
+        if (!s->hist) {
+                return -1;
+        }
+        return histogramPercentile(s->hist, percent);
+}
+
+/**
+ * Add v to the 128 bit number hi:lo.
+ */
+static void
+add128(uint64_t *hi, uint64_t *lo, uint64_t vhi, uint64_t vlo)
+{
+        *lo += vlo;
+        *hi += vhi + (*lo < vlo);
+}
+
+/**
+ * Add one RTT sample (ns)
+ */
+void
+statsAddRtt(struct Stats *s, int64_t rtt)
+{
+        uint64_t a, b, ab;
+
+        if (rtt < 0) {
+                rtt = 0;
+        }
+
+        /* rtt^2 needs 128 bits. With rtt = a*2^32 + b that's
+         * a^2*2^64 + ab*2^33 + b^2 */
+        a = (uint64_t)rtt >> 32;
+        b = (uint64_t)rtt & 0xffffffff;
+        ab = a * b;
+        add128(&s->totalTimeSquaredHi, &s->totalTimeSquaredLo,
+               a * a + (ab >> 31), ab << 33);
+        add128(&s->totalTimeSquaredHi, &s->totalTimeSquaredLo, 0, b * b);
+
+        s->totalTime += rtt;
+        s->totalTimeCount++;
+        if ((0 > s->totalMin) || (rtt < s->totalMin)) {
+                s->totalMin = rtt;
+        }
+        if ((0 > s->totalMax) || (rtt > s->totalMax)) {
+                s->totalMax = rtt;
+        }
+        if (options.sketch) {
+                if (statsSketch(s)) {
+                        sketchAdd(s->sketch, rtt);
+                }
+        } else if (statsHistogram(s)) {
+                histogramAdd(s->hist, rtt);
+        }
+}
+
+/**
+ * Add the counters of 'src' to 'dst'.
+ */
+void
+statsMerge(struct Stats *dst, const struct Stats *src)
+{
+        dst->sent += src->sent;
+        dst->recvd += src->recvd;
+        dst->dups += src->dups;
+        dst->reorder += src->reorder;
+        dst->restarts += src->restarts;
+        dst->errorInds += src->errorInds;
+        dst->totalTimeCount += src->totalTimeCount;
+        dst->totalTime += src->totalTime;
+        add128(&dst->totalTimeSquaredHi, &dst->totalTimeSquaredLo,
+               src->totalTimeSquaredHi, src->totalTimeSquaredLo);
+        if ((0 <= src->totalMin)
+            && ((0 > dst->totalMin) || (src->totalMin < dst->totalMin))) {
+                dst->totalMin = src->totalMin;
+        }
+        if ((0 <= src->totalMax)
+            && ((0 > dst->totalMax) || (src->totalMax > dst->totalMax))) {
+                dst->totalMax = src->totalMax;
+        }
+        if (options.sketch) {
+                if (src->sketch && statsSketch(dst)) {
+                        sketchMerge(dst->sketch, src->sketch);
+                }
+        } else if (src->hist && statsHistogram(dst)) {
+                histogramMerge(dst->hist, src->hist);
+        }
+        statsMergeReorder(dst, src);
+        statsMergeLoss(dst, src);
+        if (src->ipdvCount) {
+                if (!dst->ipdvCount || src->ipdvMin < dst->ipdvMin) {
+                        dst->ipdvMin = src->ipdvMin;
+                }
+                if (!dst->ipdvCount || src->ipdvMax > dst->ipdvMax) {
+                        dst->ipdvMax = src->ipdvMax;
+                }
+                dst->ipdvCount += src->ipdvCount;
+                dst->ipdvAbsSum += src->ipdvAbsSum;
+        }
+}
+
+/**
+ * print "<what> min/avg/max/mdev = ..." if there are any samples
+ */
+void
+statsPrintTimes(const char *what, const struct Stats *s)
+{
+        double avg;
+        double var;
+
+        if (!s->totalTimeCount) {
+                return;
+        }
+        avg = (double)s->totalTime / s->totalTimeCount;
+        var = (s->totalTimeSquaredHi * 18446744073709551616.0
+               + s->totalTimeSquaredLo) / s->totalTimeCount
+                - avg * avg;
+        if (var < 0) {
+                /* rounding */
+                var = 0;
+        }
+        printf("%s min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f ms",
+               what,
+               NS2MS(s->totalMin),
+               NS2MS(avg),
+               NS2MS(s->totalMax),
+               NS2MS(sqrt(var)));
+}
+
+/**
+ * print "rtt min/avg/max/mdev = ..." if there are any samples
+ */
+void
+statsPrintRtt(const struct Stats *s)
+{
+        statsPrintTimes("rtt", s);
+}
+
+/**
+ * print "<what> p50/p90/p99/p99.9/max = ..." if there are any samples.
+ * Percentiles are within a bucket width (<1%) of the real ones, or within
+ * the -A accuracy.
+ */
+void
+statsPrintPercentiles(const char *what, const struct Stats *s)
+{
+        static const double percents[] = { 50, 90, 99, 99.9 };
+        size_t c;
+
+        if (!s->totalTimeCount) {
+                return;
+        }
+        printf("%s p50/p90/p99/p99.9/max = ", what);
+        for (c = 0; c < sizeof(percents)/sizeof(percents[0]); c++) {
+                int64_t v = statsPercentile(s, percents[c]);
+                if (v < s->totalMin) {
+                        v = s->totalMin;
+                }
+                if (v > s->totalMax) {
+                        v = s->totalMax;
+                }
+                printf("%.3f/", NS2MS(v));
+        }
+        printf("%.3f ms", NS2MS(s->totalMax));
+}
+
+/**
+ * Add one IPDV sample (ns): RTT of a ping minus RTT of the one before it.
+ */
+void
+statsAddIpdv(struct Stats *s, int64_t ipdv)
+{
+        if (!s->ipdvCount || ipdv < s->ipdvMin) {
+                s->ipdvMin = ipdv;
+        }
+        if (!s->ipdvCount || ipdv > s->ipdvMax) {
+                s->ipdvMax = ipdv;
+        }
+        s->ipdvAbsSum += ipdv < 0 ? -ipdv : ipdv;
+        s->ipdvCount++;
+}
+
+/**
+ * print "jitter = ..., ipdv min/max/avg-abs = ..., pdv p50/p99/p99.9 = ..."
+ * for what there is data for. jitter <0 means don't print it.
+ *
+ * PDV (RFC 5481) is RTT minus the lowest RTT, so its percentiles come
+ * from the RTT histogram or sketch.
+ */
+void
+statsPrintDelayVar(const struct Stats *s, int64_t jitter)
+{
+        static const double percents[] = { 50, 99, 99.9 };
+        const char *sep = "";
+        size_t c;
+
+        if (jitter >= 0) {
+                printf("jitter = %.3f ms", NS2MS(jitter));
+                sep = ", ";
+        }
+        if (s->ipdvCount) {
+                printf("%sipdv min/max/avg-abs = %.3f/%.3f/%.3f ms",
+                       sep,
+                       NS2MS(s->ipdvMin),
+                       NS2MS(s->ipdvMax),
+                       NS2MS((double)s->ipdvAbsSum / s->ipdvCount));
+                sep = ", ";
+        }
+        if (!s->totalTimeCount) {
+                return;
+        }
+        printf("%spdv p50/p99/p99.9 = ", sep);
+        for (c = 0; c < sizeof(percents)/sizeof(percents[0]); c++) {
+                int64_t v = statsPercentile(s, percents[c]);
+                if (v < s->totalMin) {
+                        v = s->totalMin;
+                }
+                if (v > s->totalMax) {
+                        v = s->totalMax;
+                }
+                printf("%.3f%s", NS2MS(v - s->totalMin),
+                       c + 1 < sizeof(percents)/sizeof(percents[0])
+                       ? "/" : " ms");
+        }
+}
+
+/**
+ * Allocate a new target with settings from the command line options.
+ *
+ * return NULL on error, with errno set.
+ */
+struct Target*
+targetNew(const char *name)
+{
+        struct Target *t;
+
+        if (!(t = malloc(sizeof(struct Target)))) {
+                return NULL;
+        }
+        memset(t, 0, sizeof(struct Target));
+        if (!(t->target = strdup(name))) {
+                free(t);
+                return NULL;
+        }
+        t->fd = -1;
+        t->restartCounter = -1;
+        t->version = options.version;
+        t->has_teid = options.has_teid;
+        t->teid = options.teid;
+        t->tos = options.tos;
+        t->interval = options.interval;
+        t->wait = options.wait;
+        statsInit(&t->stats);
+        if (targetWindowResize(t, WINDOW_MIN, 0)) {
+                free(t->target);
+                free(t);
+                return NULL;
+        }
+        return t;
+}
+
+/**
+ *
+ */
+void
+targetFree(struct Target *t)
+{
+        if (t) {
+                free(t->target);
+                free(t->targetip);
+                free(t->port);
+                free(t->sendTimes);
+                free(t->rtts);
+                free(t->gotIt);
+                free(t->packet);
+                statsFree(&t->stats);
+                statsFree(&t->interim);
+                free(t);
+        }
+}
+
+/**
+ * Stats since the last interim report.
+ */
+struct Stats*
+targetInterim(struct Target *t)
+{
+        if (t->interimEpoch != interimEpoch) {
+                statsClear(&t->interim);
+                t->interimEpoch = interimEpoch;
+        }
+        return &t->interim;
+}
+
+/**
+ * Add IPDV sample to both the total and interim stats.
+ */
+static void
+targetAddIpdv(struct Target *t, int64_t ipdv)
+{
+        statsAddIpdv(&t->stats, ipdv);
+        statsAddIpdv(targetInterim(t), ipdv);
+}
+
+/**
+ * Update jitter and IPDV with the RTT of the first reply to ping 'seq',
+ * which must be in the window and marked as replied to. RFC 3550 jitter
+ * is over replies in arrival order. IPDV is between pings with
+ * consecutive sequence numbers, whatever order the replies came in: with
+ * seq - 1 if that's been replied to, and with seq + 1 if its reply came
+ * first.
+ */
+void
+targetAddDelayVar(struct Target *t, unsigned int seq, int64_t rtt)
+{
+        unsigned int mask = t->windowSize - 1;
+
+        if (t->hasPrevRtt) {
+                int64_t d = rtt - t->prevRtt;
+
+                /* J += (|D| - J) / 16, in fixed point like RFC 3550 A.8 */
+                t->jitter += (d < 0 ? -d : d) - ((t->jitter + 8) >> 4);
+        }
+        t->prevRtt = rtt;
+        t->hasPrevRtt = 1;
+
+        t->rtts[seq & mask] = rtt;
+        if (targetWindowHas(t, seq - 1) && targetWindowGotIt(t, seq - 1)) {
+                targetAddIpdv(t, rtt - t->rtts[(seq - 1) & mask]);
+        }
+        if (targetWindowHas(t, seq + 1) && targetWindowGotIt(t, seq + 1)) {
+                targetAddIpdv(t, t->rtts[(seq + 1) & mask] - rtt);
+        }
+}
+
+/**
+ * return RFC 3550 jitter in ns, or -1 if there are not enough replies yet.
+ */
+int64_t
+targetJitter(const struct Target *t)
+{
+        if (t->stats.totalTimeCount < 2) {
+                return -1;
+        }
+        return t->jitter >> 4;
+}
+
+/**
+ * Feed pings before 'end' to the loss pattern, in order. The ones that
+ * won't be among the last 'keep' in the window are fed now, before their
+ * slot is reused. With -w, so are the ones older than that.
+ *
+ * Autowait is not used here. It's 2 * average RTT, and replies later
+ * than that would count as lost.
+ *
+ * t->lossDone only gets the pings that are out of the window, so it's
+ * where targetLossUndo() can start over from.
+ */
+void
+targetLossAge(struct Target *t, unsigned int end, unsigned int keep,
+              int64_t now)
+{
+        struct Loss *l = &t->loss;
+        struct Loss *d = &t->lossDone;
+
+        while (l->next != end) {
+                if (end - l->next <= keep
+                    && (options.autowait
+                        || now - *targetWindowSendTime(t, l->next)
+                        < options.wait)) {
+                        break;
+                }
+                lossAdd(l, !targetWindowGotIt(t, l->next),
+                        &t->stats.loss, &targetInterim(t)->loss);
+                l->next++;
+        }
+        for (; end - d->next > keep; d->next++) {
+                lossAdd(d, !targetWindowGotIt(t, d->next),
+                        &t->lossDoneStats, NULL);
+        }
+}
+
+/**
+ * Ping 'seq' was fed to the loss pattern as lost, but the reply came
+ * after all. Feed the pings since t->lossDone again, and fix the stats.
+ * Must be called after the ping is marked as replied to.
+ */
+void
+targetLossUndo(struct Target *t, unsigned int seq)
+{
+        struct Loss l = t->lossDone;
+        struct LossStats now;
+        struct LossStats *total = &t->stats.loss;
+
+        if (!SEQ_BEFORE(seq, t->loss.next)) {
+                /* not fed yet */
+                return;
+        }
+        memset(&now, 0, sizeof(now));
+        for (; l.next != t->loss.next; l.next++) {
+                lossAdd(&l, !targetWindowGotIt(t, l.next), &now, NULL);
+        }
+
+        /* the total is lossDoneStats plus what was fed since */
+        lossStatsRedo(&targetInterim(t)->loss, total, &t->lossDoneStats,
+                      &now);
+        *total = t->lossDoneStats;
+        lossStatsMerge(total, &now);
+        t->loss = l;
+}
+
+/**
+ * Done pinging. Feed the rest of the pings to the loss pattern, and count
+ * what's still open. Only the total stats are updated.
+ */
+void
+targetLossFinish(struct Target *t)
+{
+        struct Loss *l = &t->loss;
+
+        for (; l->next != t->curSeq; l->next++) {
+                lossAdd(l, !targetWindowGotIt(t, l->next),
+                        &t->stats.loss, NULL);
+        }
+        lossFinish(l, &t->stats.loss);
+}
+
+/**
+ * Start a new interim report window for all targets of this thread.
+ */
+void
+targetInterimRotate()
+{
+        interimEpoch++;
+}
+
+/**
+ * Window size wanted before sending ping 'seq' at 'now'. Double it if the
+ * ping whose slot 'seq' takes over was sent less than t->wait ago,
+ * halve it if a quarter of the window already reaches back further than
+ * that.
+ *
+ * Slots never used have send time 0, so there's no need to look at
+ * whether seq has wrapped.
+ */
+unsigned int
+targetWindowWant(const struct Target *t, unsigned int seq, int64_t now)
+{
+        unsigned int size = t->windowSize;
+        int64_t quarter = t->sendTimes[(seq - size / 4) & (size - 1)];
+
+        if (now - t->sendTimes[seq & (size - 1)] < t->wait) {
+                return size < WINDOW_MAX ? size * 2 : size;
+        }
+        if (size > WINDOW_MIN && quarter && now - quarter >= t->wait) {
+                return size / 2;
+        }
+        return size;
+}
+
+/**
+ * Reallocate window to 'size' slots (power of 2), keeping whatever of the
+ * pings before 'seq' still fits.
+ *
+ * return 0 on success, <0 (-errno) on error. Old window is kept on error.
+ */
+int
+targetWindowResize(struct Target *t, unsigned int size, unsigned int seq)
+{
+        int64_t *sendTimes;
+        int64_t *rtts;
+        uint32_t *gotIt;
+        unsigned int keep;
+        unsigned int c;
+
+        if (!(sendTimes = calloc(size, sizeof(int64_t)))) {
+                return -errno;
+        }
+        if (!(rtts = malloc(size * sizeof(int64_t)))) {
+                free(sendTimes);
+                return -errno;
+        }
+        if (!(gotIt = calloc(size / 32, sizeof(uint32_t)))) {
+                free(sendTimes);
+                free(rtts);
+                return -errno;
+        }
+
+        /* slots of pings not sent yet are copied too. They're all 0 */
+        keep = size < t->windowSize ? size : t->windowSize;
+        for (c = seq - keep; c != seq; c++) {
+                unsigned int from = c & (t->windowSize - 1);
+                unsigned int to = c & (size - 1);
+                sendTimes[to] = t->sendTimes[from];
+                rtts[to] = t->rtts[from];
+                if (t->gotIt[from / 32] & (1U << (from % 32))) {
+                        gotIt[to / 32] |= 1U << (to % 32);
+                }
+        }
+        free(t->sendTimes);
+        free(t->rtts);
+        free(t->gotIt);
+        t->sendTimes = sendTimes;
+        t->rtts = rtts;
+        t->gotIt = gotIt;
+        t->windowSize = size;
+        return 0;
+}
+
+/**
+ * return where the send time of ping 'seq' is kept.
+ */
+int64_t*
+targetWindowSendTime(struct Target *t, unsigned int seq)
+{
+        return &t->sendTimes[seq & (t->windowSize - 1)];
+}
+
+/**
+ * Start tracking ping 'seq': clear its got-reply bit.
+ *
+ * return where its send time goes.
+ */
+int64_t*
+targetWindowStart(struct Target *t, unsigned int seq)
+{
+        unsigned int pos = seq & (t->windowSize - 1);
+
+        t->gotIt[pos / 32] &= ~(1U << (pos % 32));
+        return targetWindowSendTime(t, seq);
+}
+
+/**
+ * Turn the 16 bit sequence number from a packet into the full one it was
+ * sent with: the latest ping sent with those low 16 bits. WINDOW_MAX is
+ * 65536, so everything in the window maps back correctly no matter how
+ * many times the 16 bit number has wrapped.
+ */
+unsigned int
+targetSeqExtend(const struct Target *t, uint16_t seq)
+{
+        return t->curSeq - 1 - (uint16_t)(t->curSeq - 1 - seq);
+}
+
+/**
+ * return true if ping 'seq' has been sent and is still in the window.
+ * Before seq first wraps, the slots of the pings "before 0" are unused
+ * and have send time 0.
+ */
+int
+targetWindowHas(const struct Target *t, unsigned int seq)
+{
+        return t->curSeq - seq - 1 < t->windowSize
+                && t->sendTimes[seq & (t->windowSize - 1)];
+}
+
+/**
+ * return true if ping 'seq' has been replied to. Must be in the window.
+ */
+int
+targetWindowGotIt(const struct Target *t, unsigned int seq)
+{
+        unsigned int pos = seq & (t->windowSize - 1);
+
+        return !!(t->gotIt[pos / 32] & (1U << (pos % 32)));
+}
+
+/**
+ * Mark ping 'seq' as replied to. Must be in the window.
+ *
+ * return true if it already was.
+ */
+int
+targetWindowSetGotIt(struct Target *t, unsigned int seq)
+{
+        unsigned int pos = seq & (t->windowSize - 1);
+        int ret = targetWindowGotIt(t, seq);
+
+        t->gotIt[pos / 32] |= 1U << (pos % 32);
+        return ret;
+}
+
+/**
+ * Get pointer to and length of the address part of a sockaddr, plus port.
+ *
+ * return 0 on success, -1 if address family is unknown.
+ */
+static int
+sockaddrKey(const struct sockaddr *sa,
+            const unsigned char **addr, size_t *addrlen, unsigned *port)
+{
+        switch (sa->sa_family) {
+        case AF_INET: {
+                const struct sockaddr_in *sin;
+                sin = (const struct sockaddr_in*)sa;
+                *addr = (const unsigned char*)&sin->sin_addr;
+                *addrlen = sizeof(sin->sin_addr);
+                *port = ntohs(sin->sin_port);
+                return 0;
+        }
+        case AF_INET6: {
+                const struct sockaddr_in6 *sin6;
+                sin6 = (const struct sockaddr_in6*)sa;
+                *addr = (const unsigned char*)&sin6->sin6_addr;
+                *addrlen = sizeof(sin6->sin6_addr);
+                *port = ntohs(sin6->sin6_port);
+                return 0;
+        }
+        }
+        return -1;
+}
+
+/**
+ * FNV-1a over family, address and port.
+ */
+static uint32_t
+sockaddrHash(const struct sockaddr *sa)
+{
+        const unsigned char *addr;
+        size_t addrlen;
+        unsigned port;
+        uint32_t h = 2166136261U;
+        size_t c;
+
+        if (sockaddrKey(sa, &addr, &addrlen, &port)) {
+                return 0;
+        }
+        h = (h ^ sa->sa_family) * 16777619U;
+        for (c = 0; c < addrlen; c++) {
+                h = (h ^ addr[c]) * 16777619U;
+        }
+        h = (h ^ (port & 0xff)) * 16777619U;
+        h = (h ^ (port >> 8)) * 16777619U;
+        return h;
+}
+
+/**
+ * return true if a and b are the same address and port. Flow info, scope
+ * and padding is ignored.
+ */
+int
+sockaddrEqual(const struct sockaddr *a, const struct sockaddr *b)
+{
+        const unsigned char *aaddr, *baddr;
+        size_t aaddrlen, baddrlen;
+        unsigned aport, bport;
+
+        if (a->sa_family != b->sa_family) {
+                return 0;
+        }
+        if (sockaddrKey(a, &aaddr, &aaddrlen, &aport)
+            || sockaddrKey(b, &baddr, &baddrlen, &bport)) {
+                return 0;
+        }
+        return (aport == bport)
+                && (aaddrlen == baddrlen)
+                && !memcmp(aaddr, baddr, aaddrlen);
+}
+
+/**
+ *
+ */
+void
+targetTableInit(struct TargetTable *tt)
+{
+        memset(tt, 0, sizeof(struct TargetTable));
+}
+
+/**
+ * Free table and all targets in it.
+ */
+void
+targetTableFree(struct TargetTable *tt)
+{
+        size_t c;
+        for (c = 0; c < tt->num; c++) {
+                targetFree(tt->targets[c]);
+        }
+        targetTableClear(tt);
+}
+
+/**
+ * Empty the table without freeing the targets that were in it.
+ */
+void
+targetTableClear(struct TargetTable *tt)
+{
+        free(tt->targets);
+        free(tt->hash);
+        free(tt->heap);
+        targetTableInit(tt);
+}
+
+/**
+ * Resize hash table to newSize buckets (power of two) and rehash.
+ */
+static int
+targetTableRehash(struct TargetTable *tt, size_t newSize)
+{
+        struct Target **newHash;
+        size_t c;
+
+        if (!(newHash = calloc(newSize, sizeof(struct Target*)))) {
+                return -errno;
+        }
+        for (c = 0; c < tt->hashSize; c++) {
+                struct Target *t, *next;
+                for (t = tt->hash[c]; t; t = next) {
+                        uint32_t b;
+                        next = t->hashNext;
+                        b = sockaddrHash((struct sockaddr*)&t->addr)
+                                & (newSize - 1);
+                        t->hashNext = newHash[b];
+                        newHash[b] = t;
+                }
+        }
+        free(tt->hash);
+        tt->hash = newHash;
+        tt->hashSize = newSize;
+        return 0;
+}
+
+/**
+ * Add a resolved target (t->addr must be set) to the table. Table takes
+ * ownership.
+ *
+ * return 0 on success, -EEXIST if the address/port is already in the table
+ * (target is then not added), or <0 (-errno) on other error.
+ */
+int
+targetTableAdd(struct TargetTable *tt, struct Target *t)
+{
+        uint32_t b;
+
+        if (targetTableLookup(tt, (struct sockaddr*)&t->addr)) {
+                return -EEXIST;
+        }
+
+        if (tt->num == tt->alloc) {
+                size_t n = tt->alloc ? tt->alloc * 2 : 16;
+                struct Target **p;
+                if (!(p = realloc(tt->targets, n * sizeof(struct Target*)))) {
+                        return -errno;
+                }
+                tt->targets = p;
+                if (!(p = realloc(tt->heap, n * sizeof(struct Target*)))) {
+                        return -errno;
+                }
+                tt->heap = p;
+                tt->alloc = n;
+        }
+
+        /* keep load factor <= 0.5 */
+        if (2 * (tt->num + 1) > tt->hashSize) {
+                int err;
+                size_t n = tt->hashSize ? tt->hashSize * 2
+                        : TARGETTABLE_INITIAL_HASHSIZE;
+                if ((err = targetTableRehash(tt, n))) {
+                        return err;
+                }
+        }
+
+        b = sockaddrHash((struct sockaddr*)&t->addr) & (tt->hashSize - 1);
+        t->hashNext = tt->hash[b];
+        tt->hash[b] = t;
+        tt->targets[tt->num++] = t;
+        return 0;
+}
+
+/**
+ * Find target by address and port.
+ *
+ * return NULL if not found
+ */
+struct Target*
+targetTableLookup(const struct TargetTable *tt, const struct sockaddr *sa)
+{
+        struct Target *t;
+
+        if (!tt->hashSize) {
+                return NULL;
+        }
+        for (t = tt->hash[sockaddrHash(sa) & (tt->hashSize - 1)];
+             t;
+             t = t->hashNext) {
+                if (sockaddrEqual((struct sockaddr*)&t->addr, sa)) {
+                        return t;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Deadline heap. Smallest nextPingTime at heap[0].
+ */
+
+/**
+ *
+ */
+static void
+heapSwap(struct TargetTable *tt, size_t a, size_t b)
+{
+        struct Target *tmp = tt->heap[a];
+        tt->heap[a] = tt->heap[b];
+        tt->heap[b] = tmp;
+        tt->heap[a]->heapIndex = a;
+        tt->heap[b]->heapIndex = b;
+}
+
+/**
+ *
+ */
+static void
+heapUp(struct TargetTable *tt, size_t pos)
+{
+        while (pos > 0) {
+                size_t parent = (pos - 1) / 2;
+                if (tt->heap[parent]->nextPingTime
+                    <= tt->heap[pos]->nextPingTime) {
+                        break;
+                }
+                heapSwap(tt, pos, parent);
+                pos = parent;
+        }
+}
+
+/**
+ *
+ */
+static void
+heapDown(struct TargetTable *tt, size_t pos)
+{
+        for (;;) {
+                size_t l = 2 * pos + 1;
+                size_t r = l + 1;
+                size_t smallest = pos;
+                if (l < tt->heapLen
+                    && (tt->heap[l]->nextPingTime
+                        < tt->heap[smallest]->nextPingTime)) {
+                        smallest = l;
+                }
+                if (r < tt->heapLen
+                    && (tt->heap[r]->nextPingTime
+                        < tt->heap[smallest]->nextPingTime)) {
+                        smallest = r;
+                }
+                if (smallest == pos) {
+                        break;
+                }
+                heapSwap(tt, pos, smallest);
+                pos = smallest;
+        }
+}
+
+/**
+ * Schedule target. Target must be in the table and not already scheduled.
+ */
+void
+targetTableSchedule(struct TargetTable *tt, struct Target *t)
+{
+        t->heapIndex = tt->heapLen;
+        tt->heap[tt->heapLen++] = t;
+        heapUp(tt, t->heapIndex);
+}
+
+/**
+ * Target with the earliest deadline, or NULL if nothing is scheduled.
+ */
+struct Target*
+targetTableNext(const struct TargetTable *tt)
+{
+        if (!tt->heapLen) {
+                return NULL;
+        }
+        return tt->heap[0];
+}
+
+/**
+ * Call after changing t->nextPingTime of a scheduled target.
+ */
+void
+targetTableReschedule(struct TargetTable *tt, struct Target *t)
+{
+        heapUp(tt, t->heapIndex);
+        heapDown(tt, t->heapIndex);
+}
+
+/**
+ * Remove target from schedule.
+ */
+void
+targetTableUnschedule(struct TargetTable *tt, struct Target *t)
+{
+        size_t pos = t->heapIndex;
+
+        tt->heapLen--;
+        if (pos == tt->heapLen) {
+                return;
+        }
+        heapSwap(tt, pos, tt->heapLen);
+        heapUp(tt, pos);
+        heapDown(tt, pos);
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,253 @@
+/** gtping/targetlist.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Read targets from a file (or stdin) one line at a time, so that
+ * pinging can start before the whole list is read.
+ *
+ * Line format:
+ *     <host> [port=<port>] [version=<1|2>] [teid=<teid>] [dscp=<dscp>]
+ *            [interval=<time>]
+ *
+ * Anything after a '#' is a comment. Empty lines are ignored. Settings not
+ * given on a line default to what was given on the command line.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "gtping.h"
+
+/**
+ * Open target list. filename "-" means stdin.
+ *
+ * return 0 on success, <0 (-errno) on error.
+ */
+int
+targetListOpen(struct TargetList *tl, const char *filename)
+{
+        int err;
+
+        memset(tl, 0, sizeof(struct TargetList));
+        tl->filename = filename;
+        if (!strcmp(filename, "-")) {
+                tl->fd = 0;
+        } else if (0 > (tl->fd = open(filename, O_RDONLY))) {
+                err = errno;
+                fprintf(stderr, "%s: open(%s): %s\n",
+                        argv0, filename, strerror(err));
+                return -err;
+        }
+
+        /* we get called from the mainloop when there's data. Don't block
+         * on a slow pipe. */
+        if (fcntl(tl->fd, F_SETFL, fcntl(tl->fd, F_GETFL) | O_NONBLOCK)) {
+                fprintf(stderr, "%s: fcntl(%s, O_NONBLOCK): %s\n",
+                        argv0, filename, strerror(errno));
+        }
+        return 0;
+}
+
+/**
+ *
+ */
+void
+targetListClose(struct TargetList *tl)
+{
+        if (tl->fd > 0) {
+                close(tl->fd);
+        }
+        tl->fd = -1;
+        tl->eof = 1;
+}
+
+/**
+ * Read whatever is available into the buffer.
+ *
+ * return 0 on success (including EAGAIN), <0 (-errno) on error.
+ * Sets tl->eof at end of file or error. The file is left open until
+ * targetListClose().
+ */
+int
+targetListFill(struct TargetList *tl)
+{
+        ssize_t n;
+
+        if (tl->eof) {
+                return 0;
+        }
+        if (tl->len == sizeof(tl->buf)) {
+                /* buffer full and no newline in it */
+                fprintf(stderr, "%s: %s:%u: line too long, skipped\n",
+                        argv0, tl->filename, tl->lineno + 1);
+                tl->len = 0;
+                tl->skipLine = 1;
+        }
+        n = read(tl->fd, tl->buf + tl->len, sizeof(tl->buf) - tl->len);
+        if (n < 0) {
+                if (errno == EAGAIN || errno == EINTR) {
+                        return 0;
+                }
+                n = errno;
+                fprintf(stderr, "%s: read(%s): %s\n",
+                        argv0, tl->filename, strerror(n));
+                tl->eof = 1;
+                return -n;
+        }
+        if (n == 0) {
+                /* last line may lack newline */
+                if (tl->len && tl->len < sizeof(tl->buf)) {
+                        tl->buf[tl->len++] = '\n';
+                }
+                tl->eof = 1;
+                return 0;
+        }
+        tl->len += n;
+        return 0;
+}
+
+/**
+ * Get next complete line from the buffer, with comments and trailing
+ * whitespace stripped. The returned string is valid until the next call
+ * to targetListNextLine() or targetListFill().
+ *
+ * return NULL if there are no more complete lines buffered.
+ */
+char*
+targetListNextLine(struct TargetList *tl)
+{
+        for (;;) {
+                char *line = tl->buf + tl->pos;
+                char *nl;
+                char *p;
+
+                if (tl->pos >= tl->len
+                    || !(nl = memchr(line, '\n', tl->len - tl->pos))) {
+                        /* move partial line to start of buffer */
+                        memmove(tl->buf, tl->buf + tl->pos,
+                                tl->len - tl->pos);
+                        tl->len -= tl->pos;
+                        tl->pos = 0;
+                        return NULL;
+                }
+                *nl = 0;
+                tl->pos = nl - tl->buf + 1;
+                tl->lineno++;
+
+                if (tl->skipLine) {
+                        tl->skipLine = 0;
+                        continue;
+                }
+                if ((p = strchr(line, '#'))) {
+                        *p = 0;
+                }
+                for (p = line + strlen(line);
+                     p > line && isspace((unsigned char)p[-1]);
+                     p--) {
+                        p[-1] = 0;
+                }
+                while (isspace((unsigned char)*line)) {
+                        line++;
+                }
+                if (*line) {
+                        return line;
+                }
+        }
+}
+
+/**
+ * Parse one line into a new target. Line is modified.
+ *
+ * return new target, or NULL on error (already reported)
+ */
+struct Target*
+targetListParseLine(struct TargetList *tl, char *line)
+{
+        struct Target *t = 0;
+        char *tok;
+        char *save = 0;
+
+        if (!(tok = strtok_r(line, " \t", &save))) {
+                return NULL;
+        }
+        if (!(t = targetNew(tok))) {
+                fprintf(stderr, "%s: malloc(): %s\n", argv0, strerror(errno));
+                return NULL;
+        }
+
+        while ((tok = strtok_r(NULL, " \t", &save))) {
+                char *val;
+                char *end;
+
+                if (!(val = strchr(tok, '='))) {
+                        goto badtok;
+                }
+                *val++ = 0;
+                if (!*val) {
+                        goto badtok;
+                }
+                if (!strcmp(tok, "port")) {
+                        free(t->port);
+                        if (!(t->port = strdup(val))) {
+                                fprintf(stderr, "%s: strdup(): %s\n",
+                                        argv0, strerror(errno));
+                                goto errout;
+                        }
+                } else if (!strcmp(tok, "version")) {
+                        t->version = strtoul(val, &end, 0);
+                        if (*end || t->version < 1 || t->version > 2) {
+                                goto badval;
+                        }
+                } else if (!strcmp(tok, "teid")) {
+                        t->teid = strtoul(val, &end, 0);
+                        if (*end) {
+                                goto badval;
+                        }
+                        t->has_teid = 1;
+                } else if (!strcmp(tok, "dscp")) {
+                        if (-1 == (t->tos = string2Tos(val))) {
+                                goto badval;
+                        }
+                } else if (!strcmp(tok, "interval")) {
+                        double interval = strtod(val, &end);
+                        if (*end || interval < 0) {
+                                goto badval;
+                        }
+                        t->interval = SEC2NS(interval);
+                } else {
+                        val[-1] = '=';
+                        goto badtok;
+                }
+                continue;
+        badval:
+                fprintf(stderr, "%s: %s:%u: bad %s \"%s\"\n",
+                        argv0, tl->filename, tl->lineno, tok, val);
+                goto errout;
+        badtok:
+                fprintf(stderr, "%s: %s:%u: bad setting \"%s\"\n",
+                        argv0, tl->filename, tl->lineno, tok);
+                goto errout;
+        }
+        return t;
+ errout:
+        targetFree(t);
+        return NULL;
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,40 @@
+/** gtping/src/workers_generic.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * No threads (or no thread-local storage) on this system, so -j can't
+ * be more than 1. See workers_pthread.c.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gtping.h"
+
+/**
+ *
+ */
+int
+workersMax()
+{
+        return 1;
+}
+
+/**
+ * Call fn(args[c]) for every c < num, one after the other.
+ */
+void
+workersRun(size_t num, void *(*fn)(void*), void **args)
+{
+        size_t c;
+        for (c = 0; c < num; c++) {
+                fn(args[c]);
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,85 @@
+/** gtping/src/workers_pthread.c
+ *
+ *  By Thomas Habets <thomas@habets.pp.se> 2010
+ *
+ * Worker threads for -j. Each worker pings its own share of the targets
+ * using its own sockets, event loop and buffers (module state is
+ * THREADLOCAL), so workers don't share anything while they run.
+ *
+ * Systems known to use this code: Linux, FreeBSD
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "gtping.h"
+
+#define WORKERS_MAX 64
+
+/**
+ * Max number of workers workersRun() can run in parallel.
+ */
+int
+workersMax()
+{
+        return WORKERS_MAX;
+}
+
+/**
+ * Call fn(args[c]) for every c < num, each in its own thread, and wait
+ * for them all to finish.
+ *
+ * Signals are blocked in the workers, so they're handled by the calling
+ * thread. If a thread can't be started its work is done in the calling
+ * thread instead.
+ */
+void
+workersRun(size_t num, void *(*fn)(void*), void **args)
+{
+        pthread_t threads[WORKERS_MAX];
+        int started[WORKERS_MAX];
+        sigset_t all, old;
+        size_t c;
+
+        if (num > WORKERS_MAX) {
+                num = WORKERS_MAX;
+        }
+
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        for (c = 0; c < num; c++) {
+                int err;
+                started[c] = 0;
+                if ((err = pthread_create(&threads[c], NULL, fn, args[c]))) {
+                        fprintf(stderr, "%s: pthread_create(): %s\n",
+                                argv0, strerror(err));
+                        continue;
+                }
+                started[c] = 1;
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        for (c = 0; c < num; c++) {
+                if (!started[c]) {
+                        fn(args[c]);
+                }
+        }
+        for (c = 0; c < num; c++) {
+                if (started[c]) {
+                        pthread_join(threads[c], NULL);
+                }
+        }
+}
+
+/* ---- Emacs Variables ----
+ * Local Variables:
+ * c-basic-offset: 8
+ * indent-tabs-mode: nil
+ * End:
+ */